@@ -3,7 +3,32 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Number of latency histogram buckets.  Bucket 0 counts
+   requests that took less than 1 us, bucket I > 0 those that took
+   [2**(I-1), 2**I) us, and the last bucket everything longer. */
+#define HISTOGRAM_BUCKETS 24
+
+/* Statistics for one direction, read or write, of a device. */
+struct op_stats
+  {
+    unsigned long long requests;        /* Completed requests. */
+    unsigned long long sectors;         /* Sectors they moved. */
+    unsigned long long sequential;      /* Requests that started where
+                                           the previous one ended. */
+    unsigned long long by_origin[BLOCK_ORIGIN_CNT]; /* Requests per
+                                                       origin. */
+    unsigned long long wait_us;         /* Total time queued. */
+    unsigned long long service_us;      /* Total time in the driver. */
+    unsigned long long max_us;          /* Longest queued + service. */
+    unsigned long long histogram[HISTOGRAM_BUCKETS];
+  };
 
 /* A block device. */
 struct block
@@ -17,10 +42,55 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    struct block *parent;               /* Device holding a partition. */
+    block_sector_t start;               /* First sector within PARENT. */
+
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request queue, for devices with a driver. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_ready;       /* Signaled when QUEUE gains a
+                                           request. */
+    struct list queue;                  /* Pending requests by sector. */
+    struct list fifo[2];                /* Pending reads, writes by age. */
+    block_sector_t head;                /* Sector after the last one
+                                           dispatched. */
+    uint8_t *bounce;                    /* Buffer for merged requests. */
+    block_sector_t next_sector;         /* Sector after the last one
+                                           submitted. */
+    size_t depth;                       /* Number of requests queued. */
+
+    /* Completions, for devices whose driver has SUBMIT.  Accessed
+       with interrupts off, since drivers add to them from their
+       interrupt handlers. */
+    struct list completed;              /* Requests the driver finished. */
+    struct semaphore completed_cnt;     /* Number of requests in
+                                           COMPLETED. */
+
+    /* Queue statistics. */
+    struct op_stats op_stats[2];        /* For reads, writes. */
+    size_t max_depth;                   /* Most requests ever queued. */
+    unsigned long long merged;          /* Requests merged into others. */
+    unsigned long long expired;         /* Requests served by deadline. */
   };
 
+/* How long a read or a write may wait in a queue, in timer ticks,
+   before it is dispatched ahead of the elevator order.  Writers
+   rarely wait for their data to land, so reads get the shorter
+   deadline. */
+#define READ_EXPIRE (TIMER_FREQ / 10)
+#define WRITE_EXPIRE (TIMER_FREQ)
+
+/* Pages in each device's bounce buffer, which bounds how many
+   sectors the dispatcher merges into one transfer. */
+#define BOUNCE_PAGES 8
+#define MERGE_SECTORS (BOUNCE_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Time stamp counter ticks per microsecond, measured when the
+   first device registers. */
+static uint64_t tsc_per_us;
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -99,17 +169,18 @@ block_get_by_name (const char *name)
   return NULL;
 }
 
-/* Verifies that SECTOR is a valid offset within BLOCK.
-   Panics if not. */
+/* Verifies that the CNT sectors starting at SECTOR all lie
+   within BLOCK.  Panics if not. */
 static void
-check_sector (struct block *block, block_sector_t sector)
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
 {
-  if (sector >= block->size)
+  if (cnt > block->size || sector > block->size - cnt)
     {
       /* We do not use ASSERT because we want to panic here
          regardless of whether NDEBUG is defined. */
-      PANIC ("Access past end of device %s (sector=%"PRDSNu", "
-             "size=%"PRDSNu")\n", block_name (block), sector, block->size);
+      PANIC ("Access past end of device %s (sector=%"PRDSNu", cnt=%zu, "
+             "size=%"PRDSNu")\n", block_name (block), sector, cnt,
+             block->size);
     }
 }
 
@@ -120,9 +191,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +202,441 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, buffer);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  The dispatcher hands the whole range to the driver at
+   once, so it can move in as few commands as the hardware allows.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  struct block_request request;
+
+  block_request_init (&request, false, sector, cnt, buffer, NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  struct block_request request;
+
+  block_request_init (&request, true, sector, cnt, (void *) buffer,
+                      NULL, NULL);
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Initializes REQUEST to read (if WRITE is false) or write (if
+   WRITE is true) the CNT sectors starting at SECTOR into or from
+   BUFFER.  If CALLBACK is non-null, it will be called with
+   REQUEST and AUX once the transfer completes; otherwise, wait
+   for the request with block_wait(). */
+void
+block_request_init (struct block_request *request, bool write,
+                    block_sector_t sector, size_t cnt, void *buffer,
+                    block_callback *callback, void *aux)
+{
+  request->write = write;
+  request->sector = sector;
+  request->cnt = cnt;
+  request->buffer = buffer;
+  request->callback = callback;
+  request->aux = aux;
+  sema_init (&request->done, 0);
+  request->origin = BLOCK_ORIGIN_OTHER;
+}
+
+/* Like block_read_multiple(), but charges the transfer to
+   read-ahead in the statistics. */
+void
+block_read_ahead (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  struct block_request request;
+
+  block_request_init (&request, false, sector, cnt, buffer, NULL, NULL);
+  request.origin = BLOCK_ORIGIN_READAHEAD;
+  block_submit (block, &request);
+  block_wait (&request);
+}
+
+/* Returns the current value of the CPU's time stamp counter. */
+static uint64_t
+rdtsc (void)
+{
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+/* Returns the number of microseconds between time stamps START
+   and END. */
+static unsigned long long
+tsc_to_us (uint64_t start, uint64_t end)
+{
+  return tsc_per_us != 0 ? (end - start) / tsc_per_us : 0;
+}
+
+/* Measures the time stamp counter against the timer, which takes
+   up to two timer ticks. */
+static void
+calibrate_tsc (void)
+{
+  int64_t start;
+  uint64_t tsc;
+
+  start = timer_ticks ();
+  while (timer_ticks () == start)
+    barrier ();
+  start = timer_ticks ();
+  tsc = rdtsc ();
+  while (timer_ticks () == start)
+    barrier ();
+  tsc_per_us = (rdtsc () - tsc) / (1000000 / TIMER_FREQ);
+}
+
+/* Records REQUEST, which BLOCK's dispatcher handed to the driver
+   at time stamp DISPATCHED and which finished at time stamp
+   COMPLETED, in BLOCK's statistics. */
+static void
+account_request (struct block *block, const struct block_request *request,
+                 uint64_t dispatched, uint64_t completed)
+{
+  struct op_stats *st = &block->op_stats[request->write];
+  unsigned long long wait = tsc_to_us (request->submit_tsc, dispatched);
+  unsigned long long service = tsc_to_us (dispatched, completed);
+  unsigned long long total = wait + service;
+  int bucket;
+
+  st->requests++;
+  st->sectors += request->cnt;
+  if (request->sequential)
+    st->sequential++;
+  st->by_origin[request->origin]++;
+  st->wait_us += wait;
+  st->service_us += service;
+  if (total > st->max_us)
+    st->max_us = total;
+
+  for (bucket = 0; total > 0 && bucket < HISTOGRAM_BUCKETS - 1; bucket++)
+    total >>= 1;
+  st->histogram[bucket]++;
+}
+
+/* Marks REQUEST as complete. */
+static void
+complete_request (struct block_request *request)
+{
+  if (request->callback != NULL)
+    request->callback (request, request->aux);
+  else
+    sema_up (&request->done);
+}
+
+/* Returns true if request A starts at a lower sector than B. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request,
+                                              sort_elem);
+  const struct block_request *b = list_entry (b_, struct block_request,
+                                              sort_elem);
+  return a->sector < b->sector;
+}
+
+/* Queues REQUEST on BLOCK and returns without waiting for it.
+   Requests on a partition are queued on the underlying device,
+   so that a single dispatcher orders all of a disk's I/O.
+   Must not be called from an interrupt handler. */
+void
+block_submit (struct block *block, struct block_request *request)
+{
+  ASSERT (!intr_context ());
+
+  check_sectors (block, request->sector, request->cnt);
+  ASSERT (!request->write || block->type != BLOCK_FOREIGN);
+  if (request->cnt == 0)
+    {
+      complete_request (request);
+      return;
+    }
+
+  if (request->origin == BLOCK_ORIGIN_OTHER)
+    {
+      if (block == block_by_role[BLOCK_FILESYS])
+        request->origin = BLOCK_ORIGIN_FILESYS;
+      else if (block == block_by_role[BLOCK_SWAP])
+        request->origin = BLOCK_ORIGIN_SWAP;
+    }
+
+  for (;;)
+    {
+      if (request->write)
+        block->write_cnt += request->cnt;
+      else
+        block->read_cnt += request->cnt;
+      if (block->parent == NULL)
+        break;
+      request->sector += block->start;
+      block = block->parent;
+    }
+
+  request->deadline = timer_ticks () + (request->write
+                                        ? WRITE_EXPIRE : READ_EXPIRE);
+  request->submit_tsc = rdtsc ();
+  lock_acquire (&block->queue_lock);
+  request->sequential = request->sector == block->next_sector;
+  block->next_sector = request->sector + request->cnt;
+  if (++block->depth > block->max_depth)
+    block->max_depth = block->depth;
+  list_insert_ordered (&block->queue, &request->sort_elem,
+                       request_less, NULL);
+  list_push_back (&block->fifo[request->write], &request->fifo_elem);
+  cond_signal (&block->queue_ready, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Waits for REQUEST, which must not have a callback, to
+   complete. */
+void
+block_wait (struct block_request *request)
+{
+  ASSERT (request->callback == NULL);
+  sema_down (&request->done);
+}
+
+/* Returns the request that BLOCK's dispatcher should serve next:
+   the oldest request whose deadline has passed, if any, or else
+   the first request at or after the head position, wrapping
+   around to the lowest sector at the end of the disk.  BLOCK's
+   queue must be locked and nonempty. */
+static struct block_request *
+choose_request (struct block *block)
+{
+  struct block_request *expired = NULL;
+  int64_t now = timer_ticks ();
+  struct list_elem *e;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (!list_empty (&block->fifo[i]))
+      {
+        struct block_request *r = list_entry (list_front (&block->fifo[i]),
+                                              struct block_request,
+                                              fifo_elem);
+        if (r->deadline <= now
+            && (expired == NULL || r->deadline < expired->deadline))
+          expired = r;
+      }
+  if (expired != NULL)
+    {
+      block->expired++;
+      return expired;
+    }
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request,
+                                            sort_elem);
+      if (r->sector >= block->head)
+        return r;
+    }
+  return list_entry (list_front (&block->queue), struct block_request,
+                     sort_elem);
+}
+
+/* Moves FIRST and the requests that directly follow it on disk,
+   in the same direction, from BLOCK's queue into BATCH, as long
+   as they fit in BLOCK's bounce buffer together.  Returns the
+   total number of sectors moved.  BLOCK's queue must be
+   locked. */
+static size_t
+take_batch (struct block *block, struct block_request *first,
+            struct list *batch)
+{
+  struct block_request *r = first;
+  size_t cnt = 0;
+
+  for (;;)
+    {
+      struct list_elem *next = list_next (&r->sort_elem);
+      struct block_request *n;
+
+      list_remove (&r->sort_elem);
+      list_remove (&r->fifo_elem);
+      list_push_back (batch, &r->sort_elem);
+      block->depth--;
+      if (r != first)
+        block->merged++;
+      cnt += r->cnt;
+
+      if (block->bounce == NULL || next == list_end (&block->queue))
+        break;
+      n = list_entry (next, struct block_request, sort_elem);
+      if (n->write != first->write || n->sector != r->sector + r->cnt
+          || cnt + n->cnt > MERGE_SECTORS)
+        break;
+      r = n;
+    }
+  return cnt;
+}
+
+/* Has BLOCK's driver transfer CNT sectors starting at SECTOR
+   into or out of BUFFER. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          size_t cnt, uint8_t *buffer)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  if (write && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, sector, cnt, buffer);
+  else if (!write && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        if (write)
+          ops->write (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+        else
+          ops->read (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+      }
+}
+
+/* Serves the queue of the block device named NAME_, one batch
+   of requests at a time, for as long as Pintos runs.  If the
+   driver has SUBMIT, requests are only started here, and the
+   dispatcher moves on to the next one without waiting. */
+static void
+dispatcher (void *name_)
+{
+  struct block *block = block_get_by_name (name_);
+
+  ASSERT (block != NULL);
+  for (;;)
+    {
+      struct block_request *first;
+      struct list batch;
+      struct list_elem *e;
+      uint64_t dispatched, completed;
+      size_t cnt;
+
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_ready, &block->queue_lock);
+      list_init (&batch);
+      first = choose_request (block);
+      cnt = take_batch (block, first, &batch);
+      block->head = first->sector + cnt;
+      lock_release (&block->queue_lock);
+
+      if (block->ops->submit != NULL)
+        {
+          /* No bounce buffer, so the batch is just FIRST. */
+          first->dispatch_tsc = rdtsc ();
+          block->ops->submit (block->aux, first);
+          continue;
+        }
+
+      dispatched = rdtsc ();
+      if (list_size (&batch) == 1)
+        transfer (block, first->write, first->sector, cnt, first->buffer);
+      else
+        {
+          /* Gather the merged requests into the bounce buffer so
+             the driver sees a single transfer. */
+          uint8_t *p = block->bounce;
+
+          if (first->write)
+            for (e = list_begin (&batch); e != list_end (&batch);
+                 e = list_next (e))
+              {
+                struct block_request *r = list_entry (e, struct block_request,
+                                                      sort_elem);
+                memcpy (p, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+                p += r->cnt * BLOCK_SECTOR_SIZE;
+              }
+          transfer (block, first->write, first->sector, cnt, block->bounce);
+          if (!first->write)
+            for (e = list_begin (&batch); e != list_end (&batch);
+                 e = list_next (e))
+              {
+                struct block_request *r = list_entry (e, struct block_request,
+                                                      sort_elem);
+                memcpy (r->buffer, p, r->cnt * BLOCK_SECTOR_SIZE);
+                p += r->cnt * BLOCK_SECTOR_SIZE;
+              }
+        }
+
+      completed = rdtsc ();
+
+      while (!list_empty (&batch))
+        {
+          struct block_request *r = list_entry (list_pop_front (&batch),
+                                                struct block_request,
+                                                sort_elem);
+          account_request (block, r, dispatched, completed);
+          complete_request (r);
+        }
+    }
+}
+
+/* Called by BLOCK's driver, possibly in an interrupt handler,
+   when REQUEST, which it got from SUBMIT, has been transferred.
+   BLOCK's completion thread finishes the request. */
+void
+block_complete (struct block *block, struct block_request *request)
+{
+  enum intr_level old_level;
+
+  request->complete_tsc = rdtsc ();
+  old_level = intr_disable ();
+  list_push_back (&block->completed, &request->sort_elem);
+  intr_set_level (old_level);
+  sema_up (&block->completed_cnt);
+}
+
+/* Finishes the requests that the driver of the block device named
+   NAME_ reports done through block_complete(), for as long as
+   Pintos runs.  Callbacks then run here rather than in the
+   driver's interrupt handler. */
+static void
+completer (void *name_)
+{
+  struct block *block = block_get_by_name (name_);
+
+  ASSERT (block != NULL);
+  for (;;)
+    {
+      struct block_request *r;
+      enum intr_level old_level;
+
+      sema_down (&block->completed_cnt);
+      old_level = intr_disable ();
+      r = list_entry (list_pop_front (&block->completed),
+                      struct block_request, sort_elem);
+      intr_set_level (old_level);
+
+      account_request (block, r, r->dispatch_tsc, r->complete_tsc);
+      complete_request (r);
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,10 +660,62 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints BLOCK's queue and latency statistics, if it has served
+   any requests. */
+static void
+print_queue_stats (struct block *block)
+{
+  static const char *origin_names[BLOCK_ORIGIN_CNT] =
+    {"other", "filesys", "swap", "read-ahead"};
+  int op;
+
+  if (block->op_stats[0].requests + block->op_stats[1].requests == 0)
+    return;
+
+  printf ("%s: queue depth max %zu, %llu merged, %llu past deadline\n",
+          block->name, block->max_depth, block->merged, block->expired);
+  for (op = 0; op < 2; op++)
+    {
+      const struct op_stats *st = &block->op_stats[op];
+      int i;
+
+      if (st->requests == 0)
+        continue;
+      printf ("%s: %s %llu requests, %llu sectors, %llu sequential; "
+              "avg wait %llu us, avg service %llu us, max %llu us\n",
+              block->name, op ? "write" : "read", st->requests, st->sectors,
+              st->sequential, st->wait_us / st->requests,
+              st->service_us / st->requests, st->max_us);
+
+      printf ("%s: %s by origin:", block->name, op ? "write" : "read");
+      for (i = 0; i < BLOCK_ORIGIN_CNT; i++)
+        if (st->by_origin[i] != 0)
+          printf (" %s %llu", origin_names[i], st->by_origin[i]);
+      printf ("\n");
+
+      printf ("%s: %s latency us:", block->name, op ? "write" : "read");
+      for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        if (st->histogram[i] != 0)
+          {
+            if (i == 0)
+              printf (" <1:%llu", st->histogram[i]);
+            else if (i == HISTOGRAM_BUCKETS - 1)
+              printf (" >=%lu:%llu", 1ul << (i - 1), st->histogram[i]);
+            else
+              printf (" %lu-%lu:%llu", 1ul << (i - 1), (1ul << i) - 1,
+                      st->histogram[i]);
+          }
+      printf ("\n");
+    }
+}
+
+/* Prints statistics for each block device used for a Pintos role,
+   followed by queue and latency statistics for each device with
+   a dispatcher.  May be called at any time. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
@@ -176,17 +728,16 @@ block_print_stats (void)
                   block->read_cnt, block->write_cnt);
         }
     }
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    print_queue_stats (list_entry (e, struct block, list_elem));
 }
 
-/* Registers a new block device with the given NAME.  If
-   EXTRA_INFO is non-null, it is printed as part of a user
-   message.  The block device's SIZE in sectors and its TYPE must
-   be provided, as well as the it operation functions OPS, which
-   will be passed AUX in each function call. */
-struct block *
-block_register (const char *name, enum block_type type,
-                const char *extra_info, block_sector_t size,
-                const struct block_operations *ops, void *aux)
+/* Allocates and initializes a block device descriptor and adds
+   it to the list of block devices. */
+static struct block *
+new_block (const char *name, enum block_type type, block_sector_t size)
 {
   struct block *block = malloc (sizeof *block);
   if (block == NULL)
@@ -196,21 +747,107 @@ block_register (const char *name, enum block_type type,
   strlcpy (block->name, name, sizeof block->name);
   block->type = type;
   block->size = size;
-  block->ops = ops;
-  block->aux = aux;
+  block->ops = NULL;
+  block->aux = NULL;
+  block->parent = NULL;
+  block->start = 0;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_ready);
+  list_init (&block->queue);
+  list_init (&block->fifo[0]);
+  list_init (&block->fifo[1]);
+  block->head = 0;
+  block->bounce = NULL;
+  block->next_sector = 0;
+  block->depth = 0;
+  list_init (&block->completed);
+  sema_init (&block->completed_cnt, 0);
+  memset (block->op_stats, 0, sizeof block->op_stats);
+  block->max_depth = 0;
+  block->merged = 0;
+  block->expired = 0;
+  return block;
+}
 
+/* Prints the user message announcing BLOCK, including
+   EXTRA_INFO if it is non-null. */
+static void
+print_block (const struct block *block, const char *extra_info)
+{
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
   printf (")");
   if (extra_info != NULL)
     printf (", %s", extra_info);
   printf ("\n");
+}
+
+/* Registers a new block device with the given NAME.  If
+   EXTRA_INFO is non-null, it is printed as part of a user
+   message.  The block device's SIZE in sectors and its TYPE must
+   be provided, as well as the it operation functions OPS, which
+   will be passed AUX in each function call.  Starts a thread
+   that dispatches the device's queued requests to OPS and, if
+   OPS has SUBMIT, another that completes them. */
+struct block *
+block_register (const char *name, enum block_type type,
+                const char *extra_info, block_sector_t size,
+                const struct block_operations *ops, void *aux)
+{
+  struct block *block = new_block (name, type, size);
+  char thread_name[sizeof block->name + 7];
+
+  block->ops = ops;
+  block->aux = aux;
+  if (tsc_per_us == 0)
+    calibrate_tsc ();
+
+  /* Without a bounce buffer the dispatcher still works, it just
+     cannot merge requests.  A driver with SUBMIT gets none: the
+     buffer would be busy until the merged transfer completed,
+     while the driver can take many requests at once instead. */
+  if (ops->submit == NULL)
+    block->bounce = palloc_get_multiple (0, BOUNCE_PAGES);
+
+  print_block (block, extra_info);
+
+  if (ops->submit != NULL)
+    {
+      snprintf (thread_name, sizeof thread_name, "iodone-%s", block->name);
+      if (thread_create (thread_name, PRI_DEFAULT, completer,
+                         block->name) == TID_ERROR)
+        PANIC ("Failed to start completer for block device %s",
+               block->name);
+    }
+
+  snprintf (thread_name, sizeof thread_name, "io-%s", block->name);
+  if (thread_create (thread_name, PRI_DEFAULT, dispatcher,
+                     block->name) == TID_ERROR)
+    PANIC ("Failed to start dispatcher for block device %s", block->name);
 
   return block;
 }
-
+
+/* Registers a new block device with the given NAME, TYPE and
+   SIZE that consists of the sectors of PARENT starting at START,
+   and prints EXTRA_INFO as block_register() does.  Requests to
+   the new device join PARENT's queue. */
+struct block *
+block_register_partition (const char *name, enum block_type type,
+                          const char *extra_info, block_sector_t size,
+                          struct block *parent, block_sector_t start)
+{
+  struct block *block = new_block (name, type, size);
+
+  ASSERT (start <= parent->size && size <= parent->size - start);
+  block->parent = parent;
+  block->start = start;
+  print_block (block, extra_info);
+  return block;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,22 +55,108 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   A caller fills in a block_request with block_request_init(),
+   hands it to block_submit(), and then either waits for it with
+   block_wait() or, if it supplied a callback, lets the callback
+   run when the transfer is done.  Each device's dispatcher sorts
+   pending requests by sector, merges adjacent ones, and serves
+   them in elevator order, except that requests that have waited
+   past their deadline go first.  Overlapping requests may
+   complete in any order, so a caller that needs ordering must
+   wait for the first before submitting the second. */
+
+struct block_request;
+
+/* Who asked for a transfer, for statistics.  Requests left as
+   BLOCK_ORIGIN_OTHER are charged to the file system or swap if
+   they target the device in that role. */
+enum block_origin
+  {
+    BLOCK_ORIGIN_OTHER,         /* Anything else. */
+    BLOCK_ORIGIN_FILESYS,       /* File system demand I/O. */
+    BLOCK_ORIGIN_SWAP,          /* Paging to and from swap. */
+    BLOCK_ORIGIN_READAHEAD,     /* Speculative reads. */
+    BLOCK_ORIGIN_CNT
+  };
+
+/* Called in the device's dispatcher or completion thread when
+   REQUEST completes.  The request belongs to the caller again from
+   then on. */
+typedef void block_callback (struct block_request *request, void *aux);
+
+struct block_request
+  {
+    struct list_elem sort_elem;     /* Element in device queue. */
+    struct list_elem fifo_elem;     /* Element in device FIFO. */
+    bool write;                     /* Write (true) or read (false)? */
+    block_sector_t sector;          /* First sector. */
+    size_t cnt;                     /* Number of sectors. */
+    void *buffer;                   /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    int64_t deadline;               /* Dispatch by this timer tick. */
+    block_callback *callback;       /* Completion function, or null. */
+    void *aux;                      /* Passed to CALLBACK. */
+    struct semaphore done;          /* Up'd on completion if no CALLBACK. */
+
+    /* Statistics. */
+    enum block_origin origin;       /* Who asked; may be changed after
+                                       block_request_init(). */
+    bool sequential;                /* Continues the previous request? */
+    uint64_t submit_tsc;            /* Time stamp at submission. */
+    uint64_t dispatch_tsc;          /* Time stamp at submit to driver. */
+    uint64_t complete_tsc;          /* Time stamp at block_complete(). */
+  };
+
+void block_request_init (struct block_request *, bool write,
+                         block_sector_t, size_t cnt, void *buffer,
+                         block_callback *, void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+void block_read_ahead (struct block *, block_sector_t, size_t cnt, void *);
+
 /* Statistics. */
 void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* READ and WRITE are mandatory unless SUBMIT is given.
+   READ_MULTIPLE and WRITE_MULTIPLE transfer CNT consecutive sectors
+   at once; a driver that leaves them null gets one READ or WRITE
+   call per sector instead.
+
+   SUBMIT, if non-null, replaces all four.  It starts REQUEST, whose
+   sector is already relative to the device, and returns without
+   waiting for it, blocking only while the device is full.  The
+   driver reports the transfer done with block_complete(), typically
+   from its interrupt handler.  This lets the dispatcher keep as
+   many requests in flight as the device accepts. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+struct block *block_register_partition (const char *name, enum block_type,
+                                        const char *extra_info,
+                                        block_sector_t size,
+                                        struct block *parent,
+                                        block_sector_t start);
+void block_complete (struct block *, struct block_request *);
 
 #endif /* devices/block.h */
@@ -5,10 +5,13 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +33,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, for controllers that support
+   DMA.  [PIIX] places the secondary channel's registers 8 ports
+   after the primary's. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BMC_START 0x01          /* Start/stop bus master transfer. */
+#define BMC_READ 0x08           /* 1=write to memory, 0=read from memory. */
+
+/* Bus master Status Register bits. */
+#define BMS_ERR 0x02            /* Error; cleared by writing 1. */
+#define BMS_IRQ 0x04            /* Interrupt; cleared by writing 1. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +68,28 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors a single ATA command can transfer.  A sector count
+   of 0 in the Sector Count register means this many. */
+#define MAX_TRANSFER_SECTORS 256
+
+/* A Physical Region Descriptor, one entry in the table that tells
+   the bus master which memory to transfer.  A region may not
+   cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Byte count, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the last entry. */
+  };
+
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +98,10 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt with READ/WRITE
+                                   MULTIPLE, or 0 to use READ/WRITE
+                                   SECTOR. */
+    bool dma;                   /* Use READ/WRITE DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +117,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if no DMA. */
+    struct prd *prdt;           /* PRD table, one page. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -84,11 +132,20 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void enable_multiple_mode (struct ata_disk *, int max_multiple);
+static uint16_t find_bus_master (void);
+
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt, void *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const void *);
+static bool can_dma (const struct ata_disk *, const void *);
+static void dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *, bool write);
 
-static void select_sector (struct ata_disk *, block_sector_t);
-static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
+static void issue_command (struct channel *, uint8_t command);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -101,6 +158,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +184,14 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +202,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -159,6 +227,28 @@ ide_init (void)
 
 static char *descramble_ata_string (char *, int size);
 
+/* Looks for a PCI IDE controller that can act as a bus master,
+   such as the [PIIX] that QEMU emulates, and enables its bus
+   mastering.  Returns the base I/O port of its bus master
+   registers, or 0 if there is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_device pci;
+  uint16_t base;
+
+  /* Class 1 subclass 1 is an IDE controller; bit 7 of the
+     programming interface says it can do bus master DMA. */
+  if (!pci_find_class (0x01, 0x01, &pci) || !(pci.prog_if & 0x80))
+    return 0;
+
+  base = pci_read_bar (&pci, 4);
+  if (base == 0)
+    return 0;
+  pci_enable_bus_master (&pci);
+  return base;
+}
+
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
 static void
@@ -272,14 +362,14 @@ identify_ata_device (struct ata_disk *d)
      indicating the device's response is ready, and read the data
      into our buffer. */
   select_device_wait (d);
-  issue_pio_command (c, CMD_IDENTIFY_DEVICE);
+  issue_command (c, CMD_IDENTIFY_DEVICE);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
     {
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  input_sectors (c, id, 1);
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -303,12 +393,44 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Word 47 holds the largest number of sectors the disk can
+     move per interrupt with READ/WRITE MULTIPLE, 0 if it does not
+     support those commands at all. */
+  enable_multiple_mode (d, *(uint16_t *) &id[47 * 2] & 0xff);
+
+  /* Bit 8 of word 49 says whether the disk supports DMA. */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Tries to switch disk D to transferring MAX_MULTIPLE sectors
+   per interrupt with READ/WRITE MULTIPLE.  Leaves D using
+   READ/WRITE SECTOR if the disk does not support that or rejects
+   the setting. */
+static void
+enable_multiple_mode (struct ata_disk *d, int max_multiple)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (max_multiple <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), max_multiple);
+  issue_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (inb (reg_alt_status (c)) & STA_ERR)
+    printf ("%s: SET MULTIPLE MODE %d rejected\n", d->name, max_multiple);
+  else
+    d->multiple = max_multiple;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,23 +459,192 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Moves
+   up to MAX_TRANSFER_SECTORS sectors per command, by DMA if the
+   disk and BUFFER allow it and by PIO otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+  uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t chunk = cnt < MAX_TRANSFER_SECTORS ? cnt : MAX_TRANSFER_SECTORS;
+
+      lock_acquire (&c->lock);
+      if (can_dma (d, buffer))
+        dma_transfer (d, sec_no, chunk, buffer, false);
+      else
+        pio_read (d, sec_no, chunk, buffer);
+      lock_release (&c->lock);
+
+      sec_no += chunk;
+      buffer += chunk * BLOCK_SECTOR_SIZE;
+      cnt -= chunk;
+    }
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving all of the data.
+   Batches sectors into commands as ide_read_multiple() does.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer_)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t chunk = cnt < MAX_TRANSFER_SECTORS ? cnt : MAX_TRANSFER_SECTORS;
+
+      lock_acquire (&c->lock);
+      if (can_dma (d, buffer))
+        dma_transfer (d, sec_no, chunk, (void *) buffer, true);
+      else
+        pio_write (d, sec_no, chunk, buffer);
+      lock_release (&c->lock);
+
+      sec_no += chunk;
+      buffer += chunk * BLOCK_SECTOR_SIZE;
+      cnt -= chunk;
+    }
+}
+
+/* Reads CNT sectors, at most MAX_TRANSFER_SECTORS, starting at
+   SEC_NO from disk D into BUFFER by PIO, taking one interrupt per
+   sector with READ SECTOR or one per D->multiple sectors with
+   READ MULTIPLE.  D's channel must be locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffer_)
+{
+  struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+  size_t per_irq = d->multiple > 0 ? d->multiple : 1;
+  size_t done, n;
+
+  select_sector (d, sec_no, cnt);
+  issue_command (c, d->multiple > 0
+                    ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY);
+  for (done = 0; done < cnt; done += n)
+    {
+      n = cnt - done < per_irq ? cnt - done : per_irq;
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      input_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, n);
+    }
+}
+
+/* Writes CNT sectors, at most MAX_TRANSFER_SECTORS, starting at
+   SEC_NO to disk D from BUFFER by PIO, as pio_read() reads them.
+   D's channel must be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffer_)
+{
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+  size_t per_irq = d->multiple > 0 ? d->multiple : 1;
+  size_t done, n;
+
+  select_sector (d, sec_no, cnt);
+  issue_command (c, d->multiple > 0
+                    ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY);
+  for (done = 0; done < cnt; done += n)
+    {
+      /* The disk asks for the first block right away and
+         interrupts after accepting each block. */
+      n = cnt - done < per_irq ? cnt - done : per_irq;
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      output_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, n);
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Returns true if disk D can transfer BUFFER by DMA.  The bus
+   master needs a physical address, which every kernel virtual
+   address has, and regions must start on an even byte. */
+static bool
+can_dma (const struct ata_disk *d, const void *buffer)
+{
+  return d->dma && is_kernel_vaddr (buffer) && ((uintptr_t) buffer & 1) == 0;
+}
+
+/* Transfers CNT sectors, at most MAX_TRANSFER_SECTORS, starting
+   at SEC_NO between disk D and BUFFER by bus master DMA: into
+   BUFFER if WRITE is false, out of it if WRITE is true.  The CPU
+   is free to run other threads until the single completion
+   interrupt arrives.  D's channel must be locked. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uintptr_t addr = vtop (buffer);
+  size_t left = cnt * BLOCK_SECTOR_SIZE;
+  uint8_t direction = write ? 0 : BMC_READ;
+  uint8_t bm_status;
+  size_t i;
+
+  /* Describe BUFFER, which is physically contiguous because the
+     kernel maps all of physical memory linearly, splitting it
+     wherever it crosses a 64 kB boundary. */
+  for (i = 0; left > 0; i++)
+    {
+      size_t size = 0x10000 - (addr & 0xffff);
+      if (size > left)
+        size = left;
+
+      ASSERT (i < PRD_CNT);
+      c->prdt[i].addr = addr;
+      c->prdt[i].size = size & 0xffff;
+      c->prdt[i].flags = 0;
+      addr += size;
+      left -= size;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+
+  /* Program the bus master, then the disk, then start. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BMS_ERR | BMS_IRQ);
+  select_sector (d, sec_no, cnt);
+  issue_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BMC_START);
+
   sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+
+  outb (reg_bm_command (c), direction);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BMS_ERR | BMS_IRQ);
+  if ((bm_status & BMS_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    PANIC ("%s: disk DMA %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+}
+
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d, sec_no, 1, buffer);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -362,38 +653,34 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  ide_write_multiple (d, sec_no, 1, buffer);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between 1
+   and MAX_TRANSFER_SECTORS, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_TRANSFER_SECTORS);
+  ASSERT (sec_no < (1UL << 28) && cnt <= (1UL << 28) - sec_no);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_TRANSFER_SECTORS ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -404,7 +691,7 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
-issue_pio_command (struct channel *c, uint8_t command) 
+issue_command (struct channel *c, uint8_t command) 
 {
   /* Interrupts must be enabled or our semaphore will never be
      up'd by the completion handler. */
@@ -414,20 +701,21 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt) 
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes SECTORS to channel C's data register in PIO mode.
+   SECTORS must contain CNT * BLOCK_SECTOR_SIZE bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt) 
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
 /* Low-level ATA primitives. */
@@ -0,0 +1,187 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* This code accesses PCI configuration space through
+   configuration mechanism #1, the pair of I/O ports that every
+   PC chipset since the i440 provides.  See [PCI] for details. */
+
+/* Configuration mechanism #1 I/O ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Selects a register. */
+#define PCI_CONFIG_DATA 0xcfc           /* Reads or writes it. */
+
+/* Enable bit in PCI_CONFIG_ADDRESS. */
+#define PCI_CONFIG_ENABLE 0x80000000
+
+/* Header type bit that marks a multi-function device. */
+#define PCI_HEADER_MULTI 0x80
+
+static uint32_t config_read (uint8_t bus, uint8_t slot, uint8_t func,
+                             uint8_t reg);
+static void fill_device (struct pci_device *, uint8_t bus, uint8_t slot,
+                         uint8_t func);
+
+/* Selects register REG of function FUNC of device SLOT on BUS in
+   configuration space.  REG must be a multiple of 4. */
+static void
+config_select (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  ASSERT (slot < 32 && func < 8 && reg % 4 == 0);
+  outl (PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (bus << 16) | (slot << 11)
+        | (func << 8) | reg);
+}
+
+/* Returns the 32-bit register REG of function FUNC of device
+   SLOT on BUS. */
+static uint32_t
+config_read (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  config_select (bus, slot, func, reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Returns the 32-bit configuration register REG of DEV. */
+uint32_t
+pci_read_config (const struct pci_device *dev, uint8_t reg)
+{
+  return config_read (dev->bus, dev->slot, dev->func, reg);
+}
+
+/* Writes VALUE to the 32-bit configuration register REG of DEV. */
+void
+pci_write_config (const struct pci_device *dev, uint8_t reg, uint32_t value)
+{
+  config_select (dev->bus, dev->slot, dev->func, reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Returns the base address in Base Address Register BAR of DEV,
+   with the flag bits masked off.  For an I/O BAR this is a port
+   number, for a memory BAR a physical address. */
+uint32_t
+pci_read_bar (const struct pci_device *dev, int bar)
+{
+  uint32_t value;
+
+  ASSERT (bar >= 0 && bar < 6);
+  value = pci_read_config (dev, PCI_REG_BAR0 + bar * 4);
+  return value & 1 ? value & ~0x3u : value & ~0xfu;
+}
+
+/* Allows DEV to initiate DMA, and to be reached through its I/O
+   and memory BARs. */
+void
+pci_enable_bus_master (const struct pci_device *dev)
+{
+  uint32_t command = pci_read_config (dev, PCI_REG_COMMAND);
+  command |= PCI_CMD_IO | PCI_CMD_MEMORY | PCI_CMD_MASTER;
+
+  /* The upper half is the status register, whose bits are
+     cleared by writing 1s, so write back only the command. */
+  pci_write_config (dev, PCI_REG_COMMAND, command & 0xffff);
+}
+
+/* Returns true if DEV is the kind of function that AUX, a
+   pci_device, describes. */
+typedef bool match_func (const struct pci_device *dev,
+                         const struct pci_device *aux);
+
+/* Searches every bus in order for functions that MATCH accepts
+   given AUX, and stores the INDEX'th of them (counting from 0) in
+   *DEV.  Returns true if there is one, false otherwise. */
+static bool
+find (match_func *match, const struct pci_device *aux, int index,
+      struct pci_device *dev)
+{
+  int bus, slot, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (slot = 0; slot < 32; slot++)
+      for (func = 0; func < 8; func++)
+        {
+          uint32_t id = config_read (bus, slot, func, PCI_REG_ID);
+          uint32_t header;
+
+          if ((id & 0xffff) == 0xffff)
+            {
+              /* Nothing here.  A device without function 0 has no
+                 other functions either. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          fill_device (dev, bus, slot, func);
+          if (match (dev, aux) && index-- == 0)
+            return true;
+
+          header = config_read (bus, slot, func, PCI_REG_HEADER);
+          if (func == 0 && !((header >> 16) & PCI_HEADER_MULTI))
+            break;
+        }
+  return false;
+}
+
+/* Returns true if DEV has the class and sub-class of AUX. */
+static bool
+match_class (const struct pci_device *dev, const struct pci_device *aux)
+{
+  return dev->class == aux->class && dev->subclass == aux->subclass;
+}
+
+/* Returns true if DEV has the vendor and device IDs of AUX. */
+static bool
+match_id (const struct pci_device *dev, const struct pci_device *aux)
+{
+  return dev->vendor_id == aux->vendor_id && dev->device_id == aux->device_id;
+}
+
+/* Searches every bus for the first function whose base class and
+   sub-class are CLASS and SUBCLASS.  If one is found, stores its
+   location and identity in *DEV and returns true.  Otherwise,
+   returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_device *dev)
+{
+  struct pci_device aux;
+
+  aux.class = class;
+  aux.subclass = subclass;
+  return find (match_class, &aux, 0, dev);
+}
+
+/* Searches every bus for functions with the given VENDOR_ID and
+   DEVICE_ID.  If there are more than INDEX of them, stores the
+   location and identity of the INDEX'th one, counting from 0, in
+   *DEV and returns true.  Otherwise, returns false. */
+bool
+pci_find_id (uint16_t vendor_id, uint16_t device_id, int index,
+             struct pci_device *dev)
+{
+  struct pci_device aux;
+
+  aux.vendor_id = vendor_id;
+  aux.device_id = device_id;
+  return find (match_id, &aux, index, dev);
+}
+
+/* Stores the identity of function FUNC of device SLOT on BUS in
+   *DEV. */
+static void
+fill_device (struct pci_device *dev, uint8_t bus, uint8_t slot,
+             uint8_t func)
+{
+  uint32_t id = config_read (bus, slot, func, PCI_REG_ID);
+  uint32_t class = config_read (bus, slot, func, PCI_REG_CLASS);
+  uint32_t irq = config_read (bus, slot, func, PCI_REG_IRQ);
+
+  dev->bus = bus;
+  dev->slot = slot;
+  dev->func = func;
+  dev->vendor_id = id & 0xffff;
+  dev->device_id = id >> 16;
+  dev->class = class >> 24;
+  dev->subclass = class >> 16;
+  dev->prog_if = class >> 8;
+  dev->irq = irq & 0xff;
+}
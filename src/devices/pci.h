@@ -0,0 +1,43 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location and identity of a PCI function. */
+struct pci_device
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t slot;               /* Device number on the bus. */
+    uint8_t func;               /* Function number within the device. */
+    uint16_t vendor_id;         /* Vendor ID, e.g. 0x8086 for Intel. */
+    uint16_t device_id;         /* Vendor-assigned device ID. */
+    uint8_t class;              /* Base class code. */
+    uint8_t subclass;           /* Sub-class code. */
+    uint8_t prog_if;            /* Programming interface. */
+    uint8_t irq;                /* Interrupt line (legacy IRQ number). */
+  };
+
+/* Configuration space register offsets common to all headers. */
+#define PCI_REG_ID 0x00         /* Device ID:Vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Status:Command. */
+#define PCI_REG_CLASS 0x08      /* Class:Subclass:Prog IF:Revision. */
+#define PCI_REG_HEADER 0x0c     /* BIST:Header type:Latency:Cache line. */
+#define PCI_REG_BAR0 0x10       /* First Base Address Register. */
+#define PCI_REG_IRQ 0x3c        /* Max lat:Min gnt:Int pin:Int line. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MEMORY 0x0002   /* Respond to memory space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as a bus master. */
+
+uint32_t pci_read_config (const struct pci_device *, uint8_t reg);
+void pci_write_config (const struct pci_device *, uint8_t reg, uint32_t);
+uint32_t pci_read_bar (const struct pci_device *, int bar);
+void pci_enable_bus_master (const struct pci_device *);
+
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_device *);
+bool pci_find_id (uint16_t vendor_id, uint16_t device_id, int index,
+                  struct pci_device *);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,119 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <stdint.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device backed by pages from the kernel pool.  Its
+   contents start out zeroed and vanish at power off.  Transfers
+   are plain memory copies, so it shows what the file system and
+   VM code cost without any emulated disk latency on top. */
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* The RAM disk. */
+struct ramdisk
+  {
+    uint8_t **pages;            /* Backing pages. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk of SIZE_MB megabytes named "ram0" and
+   registers it with the block device layer.  Does nothing if
+   SIZE_MB is 0.  The disk has no partition table; select it for
+   a role by name, e.g. "-filesys=ram0 -f". */
+void
+ramdisk_init (size_t size_mb)
+{
+  struct ramdisk *rd;
+  size_t i;
+
+  if (size_mb == 0)
+    return;
+
+  rd = malloc (sizeof *rd);
+  if (rd == NULL)
+    PANIC ("ram0: failed to allocate disk descriptor");
+  rd->page_cnt = size_mb * (1024 * 1024 / PGSIZE);
+  rd->pages = malloc (rd->page_cnt * sizeof *rd->pages);
+  if (rd->pages == NULL)
+    PANIC ("ram0: failed to allocate page table for %zu MB", size_mb);
+
+  for (i = 0; i < rd->page_cnt; i++)
+    {
+      rd->pages[i] = palloc_get_page (PAL_ZERO);
+      if (rd->pages[i] == NULL)
+        PANIC ("ram0: out of kernel memory after %zu of %zu pages "
+               "(give the VM more memory)", i, rd->page_cnt);
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk",
+                  rd->page_cnt * SECTORS_PER_PAGE, &ramdisk_operations, rd);
+}
+
+/* Returns the address of sector SEC_NO within RD. */
+static uint8_t *
+sector_addr (struct ramdisk *rd, block_sector_t sec_no)
+{
+  return (rd->pages[sec_no / SECTORS_PER_PAGE]
+          + sec_no % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads CNT sectors starting at SEC_NO from RAM disk RD_ into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
+static void
+ramdisk_read_multiple (void *rd_, block_sector_t sec_no, size_t cnt,
+                       void *buffer_)
+{
+  struct ramdisk *rd = rd_;
+  uint8_t *buffer = buffer_;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    memcpy (buffer + i * BLOCK_SECTOR_SIZE, sector_addr (rd, sec_no + i),
+            BLOCK_SECTOR_SIZE);
+}
+
+/* Writes CNT sectors starting at SEC_NO to RAM disk RD_ from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes. */
+static void
+ramdisk_write_multiple (void *rd_, block_sector_t sec_no, size_t cnt,
+                        const void *buffer_)
+{
+  struct ramdisk *rd = rd_;
+  const uint8_t *buffer = buffer_;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    memcpy (sector_addr (rd, sec_no + i), buffer + i * BLOCK_SECTOR_SIZE,
+            BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sector SEC_NO from RAM disk RD into BUFFER. */
+static void
+ramdisk_read (void *rd, block_sector_t sec_no, void *buffer)
+{
+  ramdisk_read_multiple (rd, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO to RAM disk RD from BUFFER. */
+static void
+ramdisk_write (void *rd, block_sector_t sec_no, const void *buffer)
+{
+  ramdisk_write_multiple (rd, sec_no, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL
+  };
@@ -0,0 +1,8 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stddef.h>
+
+void ramdisk_init (size_t size_mb);
+
+#endif /* devices/ramdisk.h */
@@ -0,0 +1,174 @@
+#include "devices/shape.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/block.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+
+/* A block device that passes requests through to another one
+   while making it look slower or less reliable: it adds a fixed
+   latency to each request, caps bandwidth, and fails requests at
+   predictable points.  That lets cache, read-ahead and swap
+   policies be compared on HDD-like and SSD-like disks, and lets
+   crash recovery be tested with pintos-fsck.
+
+   Delays are charged to a per-device debt that is paid off in
+   whole timer ticks with timer_sleep(), so shaping never spins
+   the CPU.  Individual requests therefore see delays quantized to
+   ticks, but the averages over many requests come out right. */
+
+#define US_PER_TICK (1000000 / TIMER_FREQ)
+
+/* A shaped device. */
+struct shape
+  {
+    struct block *inner;        /* Device being wrapped. */
+    unsigned long latency_us;   /* Added to each request. */
+    unsigned long bandwidth_kb; /* KB per second, 0 for unlimited. */
+    unsigned long fail_at;      /* Panic on this request, 0 for never. */
+    unsigned long drop_after;   /* Discard writes after this many,
+                                   0 for never. */
+
+    unsigned long requests;     /* Requests so far. */
+    unsigned long writes;       /* Write requests so far. */
+    unsigned long long debt_us; /* Delay owed but not yet slept. */
+  };
+
+static struct block_operations shape_operations;
+
+/* Creates block device "shape0" on top of another device as
+   described by SPEC, which has the form
+   BDEV[,lat=US][,bw=KB][,fail=N][,drop=N]:
+
+     lat=US   adds US microseconds to every request.
+     bw=KB    limits transfers to KB kilobytes per second.
+     fail=N   panics on the Nth request, as a disk that died.
+     drop=N   silently discards every write after the Nth, as
+              power lost with data still in a write cache.
+
+   SPEC is modified. */
+void
+shape_init (char *spec)
+{
+  struct shape *s;
+  char *name, *option, *save_ptr;
+  char extra_info[96];
+
+  s = calloc (1, sizeof *s);
+  if (s == NULL)
+    PANIC ("shape0: failed to allocate descriptor");
+
+  name = strtok_r (spec, ",", &save_ptr);
+  if (name == NULL || (s->inner = block_get_by_name (name)) == NULL)
+    PANIC ("shape0: no such block device \"%s\"", name != NULL ? name : "");
+  if (block_type (s->inner) == BLOCK_FOREIGN)
+    PANIC ("shape0: refusing to use foreign partition %s", name);
+
+  while ((option = strtok_r (NULL, ",", &save_ptr)) != NULL)
+    {
+      char *value = strchr (option, '=');
+      unsigned long n;
+
+      if (value == NULL)
+        PANIC ("shape0: option `%s' lacks a value", option);
+      *value++ = '\0';
+      n = atoi (value);
+
+      if (!strcmp (option, "lat"))
+        s->latency_us = n;
+      else if (!strcmp (option, "bw"))
+        s->bandwidth_kb = n;
+      else if (!strcmp (option, "fail"))
+        s->fail_at = n;
+      else if (!strcmp (option, "drop"))
+        s->drop_after = n;
+      else
+        PANIC ("shape0: unknown option `%s'", option);
+    }
+
+  snprintf (extra_info, sizeof extra_info,
+            "shaping %s: %lu us, %lu KB/s, fail at %lu, drop after %lu",
+            name, s->latency_us, s->bandwidth_kb, s->fail_at, s->drop_after);
+  block_register ("shape0", BLOCK_RAW, extra_info, block_size (s->inner),
+                  &shape_operations, s);
+}
+
+/* Charges S for a request of CNT sectors and sleeps off whole
+   ticks of the accumulated delay.  Panics if this is the request
+   S was told to fail on. */
+static void
+delay (struct shape *s, size_t cnt)
+{
+  s->requests++;
+  if (s->fail_at != 0 && s->requests == s->fail_at)
+    PANIC ("shape0: injected failure of request %lu", s->requests);
+
+  s->debt_us += s->latency_us;
+  if (s->bandwidth_kb != 0)
+    s->debt_us += ((unsigned long long) cnt * BLOCK_SECTOR_SIZE * 1000000
+                   / (s->bandwidth_kb * 1024));
+
+  if (s->debt_us >= US_PER_TICK)
+    {
+      int64_t ticks = s->debt_us / US_PER_TICK;
+      s->debt_us -= ticks * US_PER_TICK;
+      timer_sleep (ticks);
+    }
+}
+
+/* Reads CNT sectors starting at SEC_NO from shaped device S_ into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
+static void
+shape_read_multiple (void *s_, block_sector_t sec_no, size_t cnt,
+                     void *buffer)
+{
+  struct shape *s = s_;
+
+  delay (s, cnt);
+  block_read_multiple (s->inner, sec_no, cnt, buffer);
+}
+
+/* Writes CNT sectors starting at SEC_NO to shaped device S_ from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes. */
+static void
+shape_write_multiple (void *s_, block_sector_t sec_no, size_t cnt,
+                      const void *buffer)
+{
+  struct shape *s = s_;
+
+  delay (s, cnt);
+  if (s->drop_after != 0 && ++s->writes > s->drop_after)
+    {
+      if (s->writes == s->drop_after + 1)
+        printf ("shape0: discarding writes from now on\n");
+      return;
+    }
+  block_write_multiple (s->inner, sec_no, cnt, buffer);
+}
+
+/* Reads sector SEC_NO from shaped device S into BUFFER. */
+static void
+shape_read (void *s, block_sector_t sec_no, void *buffer)
+{
+  shape_read_multiple (s, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO to shaped device S from BUFFER. */
+static void
+shape_write (void *s, block_sector_t sec_no, const void *buffer)
+{
+  shape_write_multiple (s, sec_no, 1, buffer);
+}
+
+static struct block_operations shape_operations =
+  {
+    shape_read,
+    shape_write,
+    shape_read_multiple,
+    shape_write_multiple,
+    NULL
+  };
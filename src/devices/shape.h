@@ -0,0 +1,6 @@
+#ifndef DEVICES_SHAPE_H
+#define DEVICES_SHAPE_H
+
+void shape_init (char *spec);
+
+#endif /* devices/shape.h */
@@ -0,0 +1,164 @@
+#include "devices/stripe.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+
+/* A RAID-0 style block device that joins several block devices
+   into one.  Consecutive chunks of CHUNK sectors go to the members
+   in turn, so a large transfer keeps all of them busy at once,
+   e.g. one disk on each IDE channel. */
+
+/* Most members a stripe set may have. */
+#define MEMBER_MAX 4
+
+/* Requests a single transfer keeps in flight at once. */
+#define BATCH_MAX 8
+
+/* Default chunk size in sectors. */
+#define DEFAULT_CHUNK 16
+
+/* A stripe set. */
+struct stripe
+  {
+    struct block *members[MEMBER_MAX];  /* Member devices. */
+    size_t member_cnt;                  /* Number of members. */
+    size_t chunk;                       /* Sectors per chunk. */
+  };
+
+static struct block_operations stripe_operations;
+
+/* Creates block device "md0" striped across the block devices
+   named in MEMBERS, a comma-separated list, with CHUNK_SECTORS
+   sectors per chunk (or a default if 0), and registers it with
+   the block device layer.  Each member contributes as many whole
+   chunks as the smallest member holds.  MEMBERS is modified. */
+void
+stripe_init (char *members, size_t chunk_sectors)
+{
+  struct stripe *s;
+  block_sector_t member_size = (block_sector_t) -1;
+  char *name, *save_ptr;
+  char extra_info[64];
+  size_t i;
+
+  s = malloc (sizeof *s);
+  if (s == NULL)
+    PANIC ("md0: failed to allocate stripe descriptor");
+  s->member_cnt = 0;
+  s->chunk = chunk_sectors > 0 ? chunk_sectors : DEFAULT_CHUNK;
+
+  for (name = strtok_r (members, ",", &save_ptr); name != NULL;
+       name = strtok_r (NULL, ",", &save_ptr))
+    {
+      struct block *block = block_get_by_name (name);
+      if (block == NULL)
+        PANIC ("md0: no such block device \"%s\"", name);
+      if (block_type (block) == BLOCK_FOREIGN)
+        PANIC ("md0: refusing to use foreign partition %s", name);
+      if (s->member_cnt >= MEMBER_MAX)
+        PANIC ("md0: more than %d members", MEMBER_MAX);
+      for (i = 0; i < s->member_cnt; i++)
+        if (s->members[i] == block)
+          PANIC ("md0: %s listed twice", name);
+
+      s->members[s->member_cnt++] = block;
+      if (block_size (block) < member_size)
+        member_size = block_size (block);
+    }
+  if (s->member_cnt == 0)
+    PANIC ("md0: no members");
+
+  member_size -= member_size % s->chunk;
+  if (member_size == 0)
+    PANIC ("md0: members are smaller than one %zu-sector chunk", s->chunk);
+
+  snprintf (extra_info, sizeof extra_info, "stripe of %zu, %zu-sector chunks",
+            s->member_cnt, s->chunk);
+  block_register ("md0", BLOCK_RAW, extra_info,
+                  member_size * s->member_cnt, &stripe_operations, s);
+}
+
+/* Transfers CNT sectors starting at SEC_NO between stripe set S
+   and BUFFER, reading into BUFFER if WRITE is false and writing
+   from it if WRITE is true.  Splits the range at chunk boundaries
+   and submits the pieces to the members without waiting, so that
+   members work in parallel, then waits for all of them. */
+static void
+transfer (struct stripe *s, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer, bool write)
+{
+  while (cnt > 0)
+    {
+      struct block_request requests[BATCH_MAX];
+      size_t req_cnt, i;
+
+      for (req_cnt = 0; req_cnt < BATCH_MAX && cnt > 0; req_cnt++)
+        {
+          block_sector_t chunk_no = sec_no / s->chunk;
+          size_t ofs = sec_no % s->chunk;
+          size_t n = s->chunk - ofs;
+          struct block *member = s->members[chunk_no % s->member_cnt];
+          block_sector_t member_sec = (chunk_no / s->member_cnt * s->chunk
+                                       + ofs);
+          if (n > cnt)
+            n = cnt;
+
+          block_request_init (&requests[req_cnt], write, member_sec, n,
+                              buffer, NULL, NULL);
+          block_submit (member, &requests[req_cnt]);
+
+          sec_no += n;
+          buffer += n * BLOCK_SECTOR_SIZE;
+          cnt -= n;
+        }
+
+      for (i = 0; i < req_cnt; i++)
+        block_wait (&requests[i]);
+    }
+}
+
+/* Reads CNT sectors starting at SEC_NO from stripe set S into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
+static void
+stripe_read_multiple (void *s, block_sector_t sec_no, size_t cnt,
+                      void *buffer)
+{
+  transfer (s, sec_no, cnt, buffer, false);
+}
+
+/* Writes CNT sectors starting at SEC_NO to stripe set S from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after every member has acknowledged its part. */
+static void
+stripe_write_multiple (void *s, block_sector_t sec_no, size_t cnt,
+                       const void *buffer)
+{
+  transfer (s, sec_no, cnt, (void *) buffer, true);
+}
+
+/* Reads sector SEC_NO from stripe set S into BUFFER. */
+static void
+stripe_read (void *s, block_sector_t sec_no, void *buffer)
+{
+  transfer (s, sec_no, 1, buffer, false);
+}
+
+/* Writes sector SEC_NO to stripe set S from BUFFER. */
+static void
+stripe_write (void *s, block_sector_t sec_no, const void *buffer)
+{
+  transfer (s, sec_no, 1, (void *) buffer, true);
+}
+
+static struct block_operations stripe_operations =
+  {
+    stripe_read,
+    stripe_write,
+    stripe_read_multiple,
+    stripe_write_multiple,
+    NULL
+  };
@@ -0,0 +1,8 @@
+#ifndef DEVICES_STRIPE_H
+#define DEVICES_STRIPE_H
+
+#include <stddef.h>
+
+void stripe_init (char *members, size_t chunk_sectors);
+
+#endif /* devices/stripe.h */
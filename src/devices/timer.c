@@ -7,7 +7,6 @@
 #include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
-#include "vm/frame.h"
 
 /* See [8254] for hardware details of the 8254 timer chip. */
 
@@ -183,7 +182,6 @@ timer_interrupt(struct intr_frame *args UNUSED) {
     ticks++;
     thread_tick();
     thread_foreach(thread_is_timer_over, NULL);
-    compute_eviction_score();
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -0,0 +1,363 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <packed.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a driver for virtio block devices,
+   as QEMU provides with "-drive if=virtio".  It speaks the
+   legacy PCI interface of [VIRTIO] 0.9.5, which QEMU still
+   offers on its transitional devices, and uses a single split
+   virtqueue with interrupt completion.  The block layer's
+   dispatcher submits requests without waiting for them, so up to
+   SLOT_MAX of them are in flight at once, and the interrupt
+   handler hands each one back with block_complete(). */
+
+/* PCI identity of a transitional virtio block device. */
+#define VIRTIO_VENDOR_ID 0x1af4
+#define VIRTIO_BLK_DEVICE_ID 0x1001
+
+/* Legacy virtio registers, relative to the I/O BAR. */
+#define reg_features(D) ((D)->io_base + 0x00)     /* Device features. */
+#define reg_guest_features(D) ((D)->io_base + 0x04) /* Driver features. */
+#define reg_queue_pfn(D) ((D)->io_base + 0x08)    /* Queue page number. */
+#define reg_queue_size(D) ((D)->io_base + 0x0c)   /* Queue size (r/o). */
+#define reg_queue_select(D) ((D)->io_base + 0x0e) /* Queue select. */
+#define reg_queue_notify(D) ((D)->io_base + 0x10) /* Queue notify. */
+#define reg_status(D) ((D)->io_base + 0x12)       /* Device status. */
+#define reg_isr(D) ((D)->io_base + 0x13)          /* ISR status. */
+#define reg_capacity(D) ((D)->io_base + 0x14)     /* 64-bit capacity. */
+
+/* Device status bits. */
+#define STATUS_ACKNOWLEDGE 0x01         /* Guest noticed the device. */
+#define STATUS_DRIVER 0x02              /* Guest can drive it. */
+#define STATUS_DRIVER_OK 0x04           /* Driver is ready. */
+#define STATUS_FAILED 0x80              /* Driver gave up. */
+
+/* The legacy interface aligns the used ring to this boundary. */
+#define VIRTQ_ALIGN 4096
+
+/* Virtqueue descriptor. */
+struct virtq_desc
+  {
+    uint64_t addr;              /* Physical address of buffer. */
+    uint32_t len;               /* Buffer length in bytes. */
+    uint16_t flags;             /* VIRTQ_DESC_F_*. */
+    uint16_t next;              /* Next descriptor if F_NEXT. */
+  } PACKED;
+
+#define VIRTQ_DESC_F_NEXT 1     /* Chain continues in NEXT. */
+#define VIRTQ_DESC_F_WRITE 2    /* Device writes (vs. reads) buffer. */
+
+/* Ring of descriptor chains offered to the device. */
+struct virtq_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the driver puts the next entry. */
+    uint16_t ring[];            /* Heads of descriptor chains. */
+  } PACKED;
+
+/* Ring of descriptor chains the device has finished with. */
+struct virtq_used_elem
+  {
+    uint32_t id;                /* Head of the finished chain. */
+    uint32_t len;               /* Bytes written into the chain. */
+  } PACKED;
+
+struct virtq_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the device puts the next entry. */
+    struct virtq_used_elem ring[];
+  } PACKED;
+
+/* Header of a virtio-blk request. */
+struct virtio_blk_req
+  {
+    uint32_t type;              /* VIRTIO_BLK_T_*. */
+    uint32_t reserved;
+    uint64_t sector;            /* In 512-byte units. */
+  } PACKED;
+
+#define VIRTIO_BLK_T_IN 0       /* Read. */
+#define VIRTIO_BLK_T_OUT 1      /* Write. */
+#define VIRTIO_BLK_S_OK 0       /* Status byte on success. */
+
+/* Each request takes a chain of three descriptors: the header,
+   the data, and the status byte.  Slot I owns descriptors 3*I
+   through 3*I+2. */
+#define DESCS_PER_SLOT 3
+#define SLOT_MAX 32
+
+/* An in-flight request. */
+struct slot
+  {
+    struct virtio_blk_req header;       /* Read by the device. */
+    uint8_t status;                     /* Written by the device. */
+    struct block_request *request;      /* Request being served. */
+  };
+
+/* A virtio block device. */
+struct virtio_blk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base of legacy I/O registers. */
+    uint8_t irq;                /* Legacy IRQ line. */
+    struct block *block;        /* Registered block device. */
+
+    uint16_t queue_size;        /* Entries in each ring. */
+    struct virtq_desc *desc;    /* Descriptor table. */
+    struct virtq_avail *avail;  /* Available ring. */
+    struct virtq_used *used;    /* Used ring. */
+    uint16_t used_idx;          /* Next used entry to reap. */
+
+    /* Only the dispatcher submits, so the available ring needs no
+       lock.  FREE is also changed by the interrupt handler and is
+       accessed with interrupts off. */
+    struct slot *slots;         /* Request slots, one page. */
+    size_t slot_cnt;            /* Number of slots. */
+    struct semaphore slots_free;        /* Number of free slots. */
+    uint8_t free[SLOT_MAX];     /* Stack of free slot numbers. */
+    size_t free_cnt;            /* Number of entries in FREE. */
+  };
+
+/* We support up to this many virtio block devices. */
+#define DEVICE_MAX 4
+static struct virtio_blk devices[DEVICE_MAX];
+static size_t device_cnt;
+
+static struct block_operations virtio_blk_operations;
+
+static bool setup_device (struct virtio_blk *, const struct pci_device *);
+static bool setup_queue (struct virtio_blk *);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds virtio block devices on the PCI bus, sets them up, and
+   registers them with the block device layer. */
+void
+virtio_blk_init (void)
+{
+  struct pci_device pci;
+
+  while (device_cnt < DEVICE_MAX
+         && pci_find_id (VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, device_cnt,
+                         &pci))
+    {
+      struct virtio_blk *d = &devices[device_cnt];
+      block_sector_t capacity;
+      char extra_info[32];
+      size_t i;
+
+      snprintf (d->name, sizeof d->name, "vd%c", 'a' + (int) device_cnt);
+      if (!setup_device (d, &pci))
+        {
+          printf ("%s: setup failed, ignoring device\n", d->name);
+          outb (reg_status (d), STATUS_FAILED);
+          return;
+        }
+
+      /* Only the low 32 bits of the capacity fit in a
+         block_sector_t. */
+      capacity = inl (reg_capacity (d));
+      if (inl (reg_capacity (d) + 4) != 0)
+        capacity = (block_sector_t) -1;
+
+      /* Share the handler among devices on the same line. */
+      for (i = 0; i < device_cnt; i++)
+        if (devices[i].irq == d->irq)
+          break;
+      if (i == device_cnt)
+        intr_register_ext (d->irq + 0x20, interrupt_handler, "virtio-blk");
+      device_cnt++;
+
+      outb (reg_status (d),
+            STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+      snprintf (extra_info, sizeof extra_info, "virtio, %zu slots",
+                d->slot_cnt);
+      d->block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
+                                 &virtio_blk_operations, d);
+      partition_scan (d->block);
+    }
+}
+
+/* Resets device D, found at PCI, and brings it to the point where
+   only setting DRIVER_OK remains.  Returns true if successful,
+   false on failure. */
+static bool
+setup_device (struct virtio_blk *d, const struct pci_device *pci)
+{
+  size_t i;
+
+  d->io_base = pci_read_bar (pci, 0);
+  d->irq = pci->irq;
+  if (d->io_base == 0 || d->irq >= 16)
+    return false;
+  pci_enable_bus_master (pci);
+
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+  /* We need none of the optional features. */
+  inl (reg_features (d));
+  outl (reg_guest_features (d), 0);
+
+  if (!setup_queue (d))
+    return false;
+
+  d->slots = palloc_get_page (PAL_ZERO);
+  if (d->slots == NULL)
+    return false;
+  d->slot_cnt = d->queue_size / DESCS_PER_SLOT;
+  if (d->slot_cnt > SLOT_MAX)
+    d->slot_cnt = SLOT_MAX;
+  ASSERT (d->slot_cnt * sizeof *d->slots <= PGSIZE);
+
+  sema_init (&d->slots_free, d->slot_cnt);
+  d->free_cnt = 0;
+  for (i = 0; i < d->slot_cnt; i++)
+    {
+      struct virtq_desc *desc = &d->desc[i * DESCS_PER_SLOT];
+
+      d->free[d->free_cnt++] = i;
+
+      /* The header and status descriptors never change. */
+      desc[0].addr = vtop (&d->slots[i].header);
+      desc[0].len = sizeof d->slots[i].header;
+      desc[0].flags = VIRTQ_DESC_F_NEXT;
+      desc[0].next = i * DESCS_PER_SLOT + 1;
+      desc[1].next = i * DESCS_PER_SLOT + 2;
+      desc[2].addr = vtop (&d->slots[i].status);
+      desc[2].len = sizeof d->slots[i].status;
+      desc[2].flags = VIRTQ_DESC_F_WRITE;
+    }
+  return true;
+}
+
+/* Allocates the descriptor table and rings of D's request queue,
+   in the layout the legacy interface requires, and tells the
+   device where they are.  Returns true if successful, false on
+   failure. */
+static bool
+setup_queue (struct virtio_blk *d)
+{
+  size_t avail_size, used_ofs, size;
+  uint8_t *queue;
+
+  outw (reg_queue_select (d), 0);
+  d->queue_size = inw (reg_queue_size (d));
+  if (d->queue_size < DESCS_PER_SLOT)
+    return false;
+
+  avail_size = sizeof *d->avail + (d->queue_size + 1) * sizeof (uint16_t);
+  used_ofs = ROUND_UP (d->queue_size * sizeof *d->desc + avail_size,
+                       VIRTQ_ALIGN);
+  size = used_ofs + sizeof *d->used
+         + d->queue_size * sizeof (struct virtq_used_elem) + sizeof (uint16_t);
+
+  queue = palloc_get_multiple (PAL_ZERO, DIV_ROUND_UP (size, PGSIZE));
+  if (queue == NULL)
+    return false;
+  d->desc = (struct virtq_desc *) queue;
+  d->avail = (struct virtq_avail *) (queue + d->queue_size * sizeof *d->desc);
+  d->used = (struct virtq_used *) (queue + used_ofs);
+  d->used_idx = 0;
+
+  outl (reg_queue_pfn (d), vtop (queue) / VIRTQ_ALIGN);
+  return true;
+}
+
+/* Starts REQUEST on device D and returns without waiting for it.
+   The device reads or writes the request's buffer directly, so it
+   must be a kernel address.  Blocks while all of D's slots are in
+   use. */
+static void
+virtio_blk_submit (void *d_, struct block_request *request)
+{
+  struct virtio_blk *d = d_;
+  struct virtq_desc *desc;
+  struct slot *slot;
+  enum intr_level old_level;
+  size_t i;
+
+  ASSERT (is_kernel_vaddr (request->buffer));
+
+  sema_down (&d->slots_free);
+  old_level = intr_disable ();
+  i = d->free[--d->free_cnt];
+  intr_set_level (old_level);
+  slot = &d->slots[i];
+  desc = &d->desc[i * DESCS_PER_SLOT];
+
+  slot->request = request;
+  slot->header.type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  slot->header.reserved = 0;
+  slot->header.sector = request->sector;
+  slot->status = 0xff;
+  desc[1].addr = vtop (request->buffer);
+  desc[1].len = request->cnt * BLOCK_SECTOR_SIZE;
+  desc[1].flags = VIRTQ_DESC_F_NEXT
+                  | (request->write ? 0 : VIRTQ_DESC_F_WRITE);
+
+  /* Publish the chain before the index that makes it visible. */
+  d->avail->ring[d->avail->idx % d->queue_size] = i * DESCS_PER_SLOT;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  outw (reg_queue_notify (d), 0);
+}
+
+static struct block_operations virtio_blk_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    virtio_blk_submit
+  };
+
+/* Virtio interrupt handler.  Frees the slot of each request that
+   any device on this line has completed and passes the request
+   back to the block layer. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  size_t i;
+
+  for (i = 0; i < device_cnt; i++)
+    {
+      struct virtio_blk *d = &devices[i];
+
+      if (d->irq + 0x20u != f->vec_no)
+        continue;
+
+      /* Reading the ISR acknowledges the interrupt. */
+      inb (reg_isr (d));
+      barrier ();
+      while (d->used_idx != d->used->idx)
+        {
+          uint32_t id = d->used->ring[d->used_idx % d->queue_size].id;
+          struct slot *slot = &d->slots[id / DESCS_PER_SLOT];
+          struct block_request *request = slot->request;
+
+          if (slot->status != VIRTIO_BLK_S_OK)
+            PANIC ("%s: disk %s failed, sector=%"PRDSNu", status=%d",
+                   d->name, request->write ? "write" : "read",
+                   request->sector, slot->status);
+          d->free[d->free_cnt++] = id / DESCS_PER_SLOT;
+          sema_up (&d->slots_free);
+          block_complete (d->block, request);
+          d->used_idx++;
+        }
+    }
+}
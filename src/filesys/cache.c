@@ -13,6 +13,7 @@
 #include "../threads/thread.h"
 #include "../vm/page.h"
 #include "../vm/frame.h"
+#include "inode.h"
 
 #define CACHE_ENTRIES 64
 
@@ -322,6 +323,7 @@ static _Noreturn void thread_flush(void *aux UNUSED) {
   while (true) {
     timer_sleep(100);
 
+    inode_flush_all();
     write_cache_to_disk();
 
     if (!list_empty(&shutdown_sema.waiters)) {
@@ -469,7 +471,10 @@ cache_block_read_chunk_readahead(struct block *block, block_sector_t sector,
 
     ASSERT(cache_get_entry(sector) != NULL);
     //d_printf("read sector %u from disk\n", sector);
-    block_read(block, sector, c_entry->data);
+    if (is_readahead)
+      block_read_ahead(block, sector, 1, c_entry->data);
+    else
+      block_read(block, sector, c_entry->data);
 
     if(!is_readahead) memcpy(buffer, c_entry->data + sector_ofs, chunk_size);
 
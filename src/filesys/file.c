@@ -118,6 +118,25 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Sets the length of FILE to LENGTH bytes, filling new bytes with
+   zeros or discarding bytes past LENGTH.
+   The file's current position is unaffected.
+   Returns true if successful, false on failure. */
+bool
+file_truncate (struct file *file, off_t length)
+{
+  return inode_truncate (file->inode, length);
+}
+
+/* Reserves disk space for SIZE bytes of FILE starting at offset
+   FILE_OFS, without changing the file's length.
+   Returns true if successful, false on failure. */
+bool
+file_allocate (struct file *file, off_t file_ofs, off_t size)
+{
+  return inode_allocate (file->inode, file_ofs, size);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
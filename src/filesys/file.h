@@ -26,6 +26,10 @@ off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
 
+/* Sizing. */
+bool file_truncate (struct file *, off_t length);
+bool file_allocate (struct file *, off_t start, off_t size);
+
 /* Preventing writes. */
 void file_deny_write (struct file *);
 void file_allow_write (struct file *);
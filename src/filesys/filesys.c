@@ -36,6 +36,8 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_all ();
+  inode_reclaim_wait ();
   free_map_close ();
 }
 
@@ -4,9 +4,12 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static size_t reserved_cnt;          /* Sectors promised, not allocated. */
+static struct lock free_map_lock;    /* Protects the three above. */
 
 /* Initializes the free map. */
 void
@@ -15,19 +18,25 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
-   Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
-bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp)
+/* Allocates CNT consecutive sectors, drawing on the caller's
+   reservation of *RESERVATION sectors first, if RESERVATION is
+   non-null.  Sectors reserved by anyone else stay free. */
+static bool
+allocate (size_t cnt, block_sector_t *sectorp, size_t *reservation)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  size_t own = reservation != NULL ? *reservation : 0;
+  size_t used = cnt < own ? cnt : own;
+  block_sector_t sector = BITMAP_ERROR;
+
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= own);
+  if (bitmap_at_least_count (free_map, reserved_cnt - used + cnt, false))
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
   if (sector != BITMAP_ERROR
       && free_map_file != NULL
       && !bitmap_write (free_map, free_map_file))
@@ -35,24 +44,129 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
       bitmap_set_multiple (free_map, sector, cnt, false); 
       sector = BITMAP_ERROR;
     }
+  if (sector != BITMAP_ERROR)
+    {
+      reserved_cnt -= used;
+      if (reservation != NULL)
+        *reservation -= used;
+    }
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates CNT consecutive sectors from the free map and stores
+   the first into *SECTORP.  Sectors promised by
+   free_map_reserve() are left alone.
+   Returns true if successful, false if not enough consecutive
+   sectors were available or if the free_map file could not be
+   written. */
+bool
+free_map_allocate (size_t cnt, block_sector_t *sectorp)
+{
+  return allocate (cnt, sectorp, NULL);
+}
+
+/* Like free_map_allocate(), but may use the *RESERVATION sectors
+   the caller holds from free_map_reserve().  As many of the
+   allocated sectors as possible count against that reservation,
+   which is reduced by that many. */
+bool
+free_map_allocate_reserved (size_t cnt, block_sector_t *sectorp,
+                            size_t *reservation)
+{
+  return allocate (cnt, sectorp, reservation);
+}
+
 bool
 free_map_has_enough_space (size_t cnt)
 {
-  return bitmap_at_least_count(free_map, cnt, false);
+  bool enough;
+
+  lock_acquire (&free_map_lock);
+  enough = bitmap_at_least_count(free_map, reserved_cnt + cnt, false);
+  lock_release (&free_map_lock);
+  return enough;
+}
+
+/* Promises CNT sectors to a later allocation without allocating
+   them yet.  Reserved sectors count as used for
+   free_map_has_enough_space() and free_map_allocate().
+   Returns true if successful, false if not enough sectors are
+   free. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool enough;
+
+  lock_acquire (&free_map_lock);
+  enough = bitmap_at_least_count (free_map, reserved_cnt + cnt, false);
+  if (enough)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return enough;
+}
+
+/* Gives back CNT sectors promised by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
   bitmap_write (free_map, free_map_file);
+  lock_release (&free_map_lock);
+}
+
+/* Like free_map_release(), but RESERVED of the sectors go back
+   into the caller's reservation of *RESERVATION sectors, undoing
+   free_map_allocate_reserved() for them. */
+void
+free_map_release_reserved (block_sector_t sector, size_t cnt,
+                           size_t reserved, size_t *reservation)
+{
+  ASSERT (reserved <= cnt);
+
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, false);
+  bitmap_write (free_map, free_map_file);
+  reserved_cnt += reserved;
+  *reservation += reserved;
+  lock_release (&free_map_lock);
+}
+
+/* Makes the CNT sectors listed in SECTORS available for use.
+   The sectors need not be consecutive.  Unlike calling
+   free_map_release() once per sector, the free map is written
+   to disk only once. */
+void
+free_map_release_multiple (const block_sector_t *sectors, size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      ASSERT (bitmap_test (free_map, sectors[i]));
+      bitmap_reset (free_map, sectors[i]);
+    }
+  bitmap_write (free_map, free_map_file);
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
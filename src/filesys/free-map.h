@@ -12,8 +12,13 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_reserved (size_t, block_sector_t *, size_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_reserved (block_sector_t, size_t, size_t, size_t *);
+void free_map_release_multiple (const block_sector_t *, size_t);
 
 bool free_map_has_enough_space (size_t cnt);
+bool free_map_reserve (size_t cnt);
+void free_map_unreserve (size_t cnt);
 
 #endif /* filesys/free-map.h */
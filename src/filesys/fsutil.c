@@ -1,5 +1,6 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -69,26 +70,95 @@ fsutil_rm (char **argv)
     PANIC ("%s: delete failed\n", file_name);
 }
 
+/* Number of pages in the read-ahead window used by
+   fsutil_extract(). */
+#define EXTRACT_WINDOW_PAGES 16
+#define EXTRACT_WINDOW_SECTORS \
+        (EXTRACT_WINDOW_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Sequential reader over the ustar stream on a block device.
+   Sectors are read ahead into a multi-page window so that the
+   extractor can hand large contiguous chunks to file_write()
+   instead of going through the file system one sector at a
+   time. */
+struct ustar_stream
+  {
+    struct block *block;        /* Source device. */
+    block_sector_t next;        /* Next sector to read from BLOCK. */
+    uint8_t *window;            /* EXTRACT_WINDOW_SECTORS sectors. */
+    size_t ofs;                 /* First unconsumed sector in WINDOW. */
+    size_t cnt;                 /* Number of valid sectors in WINDOW. */
+  };
+
+/* Returns the number of the next sector that STREAM will hand
+   out. */
+static block_sector_t
+ustar_stream_tell (const struct ustar_stream *stream)
+{
+  return stream->next - (stream->cnt - stream->ofs);
+}
+
+/* Consumes up to MAX_CNT sectors from STREAM, refilling the
+   read-ahead window if it is empty.  Returns the consumed
+   sectors, which stay valid until the next call, and stores
+   their number in *CNT. */
+static const uint8_t *
+ustar_stream_next (struct ustar_stream *stream, size_t max_cnt, size_t *cnt)
+{
+  const uint8_t *p;
+
+  ASSERT (max_cnt > 0);
+
+  if (stream->ofs == stream->cnt)
+    {
+      block_sector_t left = block_size (stream->block) - stream->next;
+
+      if (left == 0)
+        PANIC ("ustar archive runs past end of scratch device");
+      stream->ofs = 0;
+      stream->cnt = left < EXTRACT_WINDOW_SECTORS
+                    ? left : EXTRACT_WINDOW_SECTORS;
+      block_read_multiple (stream->block, stream->next, stream->cnt,
+                           stream->window);
+      stream->next += stream->cnt;
+    }
+
+  *cnt = stream->cnt - stream->ofs;
+  if (*cnt > max_cnt)
+    *cnt = max_cnt;
+  p = stream->window + stream->ofs * BLOCK_SECTOR_SIZE;
+  stream->ofs += *cnt;
+  return p;
+}
+
 /* Extracts a ustar-format tar archive from the scratch block
-   device into the Pintos file system. */
+   device into the Pintos file system.
+
+   Each file is created at its final size, taken from its ustar
+   header, so its sectors are allocated up front and file_write()
+   never has to extend it.  The data is then copied out of the
+   read-ahead window in chunks of up to EXTRACT_WINDOW_SECTORS
+   sectors. */
 void
 fsutil_extract (char **argv UNUSED) 
 {
   static block_sector_t sector = 0;
 
-  struct block *src;
-  void *header, *data;
+  struct ustar_stream stream;
+  void *header;
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
-  if (header == NULL || data == NULL)
+  stream.window = palloc_get_multiple (0, EXTRACT_WINDOW_PAGES);
+  if (header == NULL || stream.window == NULL)
     PANIC ("couldn't allocate buffers");
 
   /* Open source block device. */
-  src = block_get_role (BLOCK_SCRATCH);
-  if (src == NULL)
+  stream.block = block_get_role (BLOCK_SCRATCH);
+  if (stream.block == NULL)
     PANIC ("couldn't open scratch device");
+  stream.next = sector;
+  stream.ofs = stream.cnt = 0;
 
   printf ("Extracting ustar archive from scratch device "
           "into file system...\n");
@@ -98,13 +168,19 @@ fsutil_extract (char **argv UNUSED)
       const char *file_name;
       const char *error;
       enum ustar_type type;
+      block_sector_t header_sector;
+      size_t cnt;
       int size;
 
-      /* Read and parse ustar header. */
-      block_read (src, sector++, header);
+      /* Read and parse ustar header.  The header is copied out
+         of the window because FILE_NAME points into it. */
+      header_sector = ustar_stream_tell (&stream);
+      memcpy (header, ustar_stream_next (&stream, 1, &cnt),
+              BLOCK_SECTOR_SIZE);
       error = ustar_parse_header (header, &file_name, &type, &size);
       if (error != NULL)
-        PANIC ("bad ustar header in sector %"PRDSNu" (%s)", sector - 1, error);
+        PANIC ("bad ustar header in sector %"PRDSNu" (%s)",
+               header_sector, error);
 
       if (type == USTAR_EOF)
         {
@@ -119,7 +195,8 @@ fsutil_extract (char **argv UNUSED)
 
           printf ("Putting '%s' into the file system...\n", file_name);
 
-          /* Create destination file. */
+          /* Create destination file, preallocated to its final
+             size. */
           if (!filesys_create (file_name, size))
             PANIC ("%s: create failed", file_name);
           bool is_dir;
@@ -131,10 +208,15 @@ fsutil_extract (char **argv UNUSED)
           /* Do copy. */
           while (size > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
-                                : size);
-              block_read (src, sector++, data);
+              const uint8_t *data;
+              int chunk_size;
+
+              data = ustar_stream_next (&stream,
+                                        DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE),
+                                        &cnt);
+              chunk_size = cnt * BLOCK_SECTOR_SIZE;
+              if (chunk_size > size)
+                chunk_size = size;
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
@@ -145,6 +227,7 @@ fsutil_extract (char **argv UNUSED)
           file_close (dst);
         }
     }
+  sector = ustar_stream_tell (&stream);
 
   /* Erase the ustar header from the start of the block device,
      so that the extraction operation is idempotent.  We erase
@@ -152,10 +235,10 @@ fsutil_extract (char **argv UNUSED)
      end-of-archive marker. */
   printf ("Erasing ustar archive...\n");
   memset (header, 0, BLOCK_SECTOR_SIZE);
-  block_write (src, 0, header);
-  block_write (src, 1, header);
+  block_write (stream.block, 0, header);
+  block_write (stream.block, 1, header);
 
-  free (data);
+  palloc_free_multiple (stream.window, EXTRACT_WINDOW_PAGES);
   free (header);
 }
 
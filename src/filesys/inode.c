@@ -7,6 +7,8 @@
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "cache.h"
 
 /* Identifies an inode. */
@@ -18,6 +20,8 @@
 #define NUM_DIRECT_POINTERS 124
 #define DIRECT_LIMIT (NUM_DIRECT_POINTERS - 1)
 #define INDIRECT_LIMIT (NUM_POINTERS_PER_TABLE + DIRECT_LIMIT)
+#define MAX_DATA_SECTORS (INDIRECT_LIMIT + 1 \
+                          + NUM_POINTERS_PER_TABLE * MAX_DOUBLE_INDIRECT_TABLES)
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
@@ -51,14 +55,69 @@ struct inode
     struct list_elem elem;              /* Element in inode list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    int close_cnt;                      /* Last closes still flushing. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
     struct lock extend_lock;
+
+    /* Delayed allocation.  Data appended to a regular file is
+       kept in DELALLOC, one sector per BLOCK_SECTOR_SIZE bytes
+       starting with data sector DELALLOC_FIRST, until it is
+       flushed.  Only then are disk sectors allocated for it, all
+       at once.  LENGTH is the length seen by readers and
+       writers; DATA.LENGTH only covers data written to disk
+       sectors.  DELALLOC is nonnull exactly when LENGTH exceeds
+       DATA.LENGTH.  Protected by EXTEND_LOCK. */
+    off_t length;                       /* Logical file size in bytes. */
+    uint8_t *delalloc;                  /* Buffered sectors, or null. */
+    size_t delalloc_first;              /* First buffered data sector. */
+    size_t delalloc_reserved;           /* Free map sectors reserved. */
+
+    /* Speculative preallocation.  ALLOCATED is the number of data
+       sectors allocated to the inode, which may exceed what
+       LENGTH needs.  Data sectors PREALLOC_FIRST and up were
+       allocated speculatively by a flush and are trimmed when the
+       inode is closed for the last time.  Protected by
+       EXTEND_LOCK. */
+    size_t allocated;                   /* Allocated data sectors. */
+    size_t prealloc_first;              /* First speculative sector. */
   };
 
+/* Maximum number of sectors buffered for delayed allocation per
+   inode. */
+#define DELALLOC_SECTORS 64
+
+/* Maximum number of sectors allocated speculatively past the end
+   of a growing file by one flush.  Up to this limit, each flush
+   that needs new sectors allocates as many extra sectors as the
+   file then has, so the allocation grows geometrically. */
+#define PREALLOC_MAX_SECTORS 256
+
 
 static bool inode_disk_extend(struct inode_disk *disk_inode, uint32_t new_size);
+static size_t allocated_sectors (const struct inode_disk *);
+
+/* A sector full of zeros. */
+static const char zeros[BLOCK_SECTOR_SIZE];
+
+/* Removed inodes whose blocks have not been freed yet.
+
+   Freeing a large file touches every one of its pointer tables,
+   so inode_close() does not do it itself.  The last close of a
+   removed inode puts the inode on this queue instead, and the
+   "fs-reclaim" thread frees its sectors in batches of
+   RECLAIM_BATCH, writing the free map once per batch. */
+#define RECLAIM_BATCH 512
+
+static struct list reclaim_queue;       /* Removed inodes, via elem. */
+static int reclaim_pending;             /* Queued or being freed. */
+static struct lock reclaim_lock;        /* Protects the two above. */
+static struct condition reclaim_ready;  /* Signaled when queue nonempty. */
+static struct condition reclaim_idle;   /* Signaled when pending is 0. */
+
+static void reclaim_enqueue (struct inode *);
+static void reclaim_thread (void *aux);
 
 
 bool inode_is_directory(struct inode *i)
@@ -78,7 +137,7 @@ block_sector_t inode_get_sector(struct inode *i)
 off_t inode_get_length(struct inode *i)
 {
   ASSERT(i != NULL);
-  return i->data.length;
+  return i->length;
 }
 
 /* Returns the block device sector that contains byte offset POS
@@ -131,12 +190,28 @@ byte_to_sector (const struct inode *inode, off_t pos)
 /* List of open inodes, so that opening a single inode twice
    returns the same `struct inode'. */
 static struct list open_inodes;
+static struct lock open_inodes_lock;
+
+static bool inode_flush_delalloc (struct inode *, bool speculate);
+static void inode_trim_prealloc (struct inode *);
+static bool delalloc_access (struct inode *, off_t offset, void *buffer,
+                             int size, bool write);
+static bool delalloc_copy (struct inode *, off_t offset, void *buffer,
+                           int size, bool write);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
   list_init (&open_inodes);
+  lock_init (&open_inodes_lock);
+
+  list_init (&reclaim_queue);
+  reclaim_pending = 0;
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_ready);
+  cond_init (&reclaim_idle);
+  thread_create ("fs-reclaim", PRI_DEFAULT, reclaim_thread, "system");
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -193,6 +268,8 @@ inode_open (block_sector_t sector)
   struct list_elem *e;
   struct inode *inode;
 
+  lock_acquire (&open_inodes_lock);
+
   /* Check whether this inode is already open. */
   for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
        e = list_next (e)) 
@@ -201,6 +278,7 @@ inode_open (block_sector_t sector)
       if (inode->sector == sector) 
         {
           inode_reopen (inode);
+          lock_release (&open_inodes_lock);
           return inode; 
         }
     }
@@ -208,17 +286,27 @@ inode_open (block_sector_t sector)
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
   list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->close_cnt = 0;
   inode->deny_write_cnt = 0;
   inode->removed = false;
   lock_init(&inode->extend_lock);
   cache_block_read (fs_device, inode->sector, &inode->data);
-  ASSERT(inode != NULL);
+  inode->length = inode->data.length;
+  inode->delalloc = NULL;
+  inode->delalloc_first = 0;
+  inode->delalloc_reserved = 0;
+  inode->allocated = allocated_sectors (&inode->data);
+  inode->prealloc_first = inode->allocated;
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -240,79 +328,63 @@ inode_get_inumber (const struct inode *inode)
 
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, queues it so that its
+   blocks are freed by the reclaimer thread. */
 void
 inode_close (struct inode *inode) 
 {
+  bool flushed = true;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
-  {
-    /* Remove from inode list and release lock. */
-    list_remove (&inode->elem);
-
-    /* Deallocate blocks if removed. */
-    if (inode->removed)
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
     {
-      // delete all data sectors, indirect table and
-      // table of tables and indirect tables
-      for (uint32_t i = 0; i < NUM_DIRECT_POINTERS; i++)
-      {
-        if (inode->data.direct[i] != 0)
-          free_map_release (inode->data.direct[i], 1);
-      }
-
-      if (inode->data.indirect != 0)
-      {
-        struct inode_disk_pointer_table indirect_table;
-        // load indirect table
-        cache_block_read(fs_device, inode->data.indirect, &indirect_table);
-        for (uint32_t i = 0; i < NUM_POINTERS_PER_TABLE; i++)
-        {
-          // delete entry
-          if (indirect_table.pointers[i] != 0)
-            free_map_release (indirect_table.pointers[i], 1);
-        }
-
-        // delete indirect table
-        free_map_release (inode->data.indirect, 1);
-      }
-
-      if (inode->data.doubleindirect != 0)
-      {
-        struct inode_disk_pointer_table table_of_tables;
-        // load table of tables
-        cache_block_read(fs_device, inode->data.indirect, &table_of_tables);
-        for (uint32_t i = 0; i < NUM_POINTERS_PER_TABLE; i++)
-        {
-          if (table_of_tables.pointers[i] == 0) break;
-          // load table
-          struct inode_disk_pointer_table table;
-          cache_block_read(fs_device, table_of_tables.pointers[i], &table);
-          // delete every entry from the table
-          for (uint32_t j = 0; j < NUM_POINTERS_PER_TABLE; j++)
-          {
-            // delete entry
-            if (table.pointers[i] != 0)
-              free_map_release (table.pointers[i], 1);
-          }
-          // delete table
-          free_map_release (table_of_tables.pointers[i], 1);
-        }
-
-        // delete table of tables
-        free_map_release (inode->data.doubleindirect, 1);
-      }
-
-      // delete inode_data
-      free_map_release (inode->sector, 1);
+      lock_release (&open_inodes_lock);
+      return;
+    }
+  inode->close_cnt++;
+  lock_release (&open_inodes_lock);
+
+  /* Write out data waiting for delayed allocation and give back
+     speculatively allocated sectors.  INODE stays on the list
+     meanwhile, so inode_open() of its sector finds this copy
+     instead of reading the one on disk that we are rewriting. */
+  if (!inode->removed)
+    {
+      lock_acquire (&inode->extend_lock);
+      flushed = inode_flush_delalloc (inode, false);
+      inode_trim_prealloc (inode);
+      lock_release (&inode->extend_lock);
     }
 
+  /* Release resources unless INODE was reopened in the meantime,
+     or reopened and closed again by a thread that is still
+     flushing. */
+  lock_acquire (&open_inodes_lock);
+  if (--inode->close_cnt > 0 || inode->open_cnt > 0)
+    {
+      lock_release (&open_inodes_lock);
+      return;
+    }
+  list_remove (&inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (!flushed)
+    printf ("inode %"PRDSNu": lost %"PROTd" bytes of delayed data, "
+            "could not allocate them\n", inode->sector,
+            inode->length - inode->data.length);
+  free_map_unreserve (inode->delalloc_reserved);
+  free (inode->delalloc);
+
+  /* Hand removed inodes to the reclaimer, which frees their
+     blocks in the background. */
+  if (inode->removed)
+    reclaim_enqueue (inode);
+  else
     free (inode);
-  }
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -342,7 +414,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   while (size > 0) 
   {
     /* Disk sector to read, starting byte offset within sector. */
-    block_sector_t sector_idx = byte_to_sector (inode, offset);
+    block_sector_t sector_idx;
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
     /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -355,13 +427,20 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+    if (delalloc_access (inode, offset, buffer + bytes_read, chunk_size,
+                         false))
+    {
+      /* Data has no disk sector yet. */
+    }
+    else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
     {
       /* Read full sector directly into caller's buffer. */
+      sector_idx = byte_to_sector (inode, offset);
       cache_block_read (fs_device, sector_idx, buffer + bytes_read);
     }
     else
     {
+      sector_idx = byte_to_sector (inode, offset);
       cache_block_read_chunk(fs_device, sector_idx,
          buffer + bytes_read, chunk_size, sector_ofs);
     }
@@ -393,8 +472,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      ASSERT(sector_idx != UINT32_MAX);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -407,17 +485,32 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      /* Held until the data is in the cache: otherwise the sector
+         could be buffered for delayed allocation in between, and
+         the buffer's older copy would overwrite this write when it
+         is flushed. */
+      lock_acquire (&inode->extend_lock);
+      if (delalloc_copy (inode, offset, (void *) (buffer + bytes_written),
+                         chunk_size, true))
+        {
+          /* Data has no disk sector yet. */
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Write full sector directly to disk. */
+          sector_idx = byte_to_sector (inode, offset);
+          ASSERT(sector_idx != UINT32_MAX);
           cache_block_write (fs_device, sector_idx, buffer + bytes_written);
         }
       else 
         {
+          sector_idx = byte_to_sector (inode, offset);
+          ASSERT(sector_idx != UINT32_MAX);
           cache_block_write_chunk(fs_device, sector_idx,
                                   buffer + bytes_written, chunk_size,
                                   sector_ofs);
         }
+      lock_release (&inode->extend_lock);
 
       /* Advance. */
       size -= chunk_size;
@@ -452,7 +545,7 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (const struct inode *inode)
 {
-  return inode->data.length;
+  return inode->length;
 }
 
 static uint32_t required_sectors_for_data_sectors(uint32_t data_sectors)
@@ -471,171 +564,746 @@ static uint32_t required_sectors_for_data_sectors(uint32_t data_sectors)
   return ret;
 }
 
-static bool inode_disk_extend(struct inode_disk *disk_inode, uint32_t new_size)
+/* Returns the data sector with index IDX of DISK_INODE, or 0 if
+   it is not allocated. */
+static block_sector_t
+get_data_sector (const struct inode_disk *disk_inode, size_t idx)
 {
-  ASSERT(disk_inode != NULL);
-  ASSERT(new_size > (uint32_t)disk_inode->length);
+  block_sector_t table, sector;
 
-  size_t new_sector_num = bytes_to_sectors ((int32_t)new_size);
-  size_t old_sector_num = bytes_to_sectors (disk_inode->length);
+  if (idx < NUM_DIRECT_POINTERS)
+    return disk_inode->direct[idx];
+  if (idx <= INDIRECT_LIMIT)
+    {
+      table = disk_inode->indirect;
+      idx -= NUM_DIRECT_POINTERS;
+    }
+  else
+    {
+      idx -= INDIRECT_LIMIT + 1;
+      if (disk_inode->doubleindirect == 0)
+        return 0;
+      cache_block_read_chunk (fs_device, disk_inode->doubleindirect, &table,
+                              sizeof table,
+                              sizeof table * (idx / NUM_POINTERS_PER_TABLE));
+      idx %= NUM_POINTERS_PER_TABLE;
+    }
+  if (table == 0)
+    return 0;
+  cache_block_read_chunk (fs_device, table, &sector, sizeof sector,
+                          sizeof sector * idx);
+  return sector;
+}
 
-  size_t num_sectors_to_allocate = required_sectors_for_data_sectors(new_sector_num)
-		  - required_sectors_for_data_sectors(old_sector_num);
+/* Allocates a pointer table filled with zeros and stores its
+   sector in *SECTORP, drawing on *RESERVATION if non-null. */
+static bool
+allocate_table (block_sector_t *sectorp, size_t *reservation)
+{
+  if (!free_map_allocate_reserved (1, sectorp, reservation))
+    return false;
+  cache_block_write (fs_device, *sectorp, zeros);
+  return true;
+}
 
-  if (!free_map_has_enough_space(num_sectors_to_allocate))
-  {
-	return false;
-  }
+/* Makes SECTOR the data sector with index IDX of DISK_INODE,
+   allocating pointer tables as needed, from *RESERVATION if that
+   is non-null.  Returns false if a table could not be
+   allocated. */
+static bool
+set_data_sector (struct inode_disk *disk_inode, size_t idx,
+                 block_sector_t sector, size_t *reservation)
+{
+  block_sector_t table;
+
+  if (idx < NUM_DIRECT_POINTERS)
+    {
+      disk_inode->direct[idx] = sector;
+      return true;
+    }
+  if (idx <= INDIRECT_LIMIT)
+    {
+      if (disk_inode->indirect == 0 && !allocate_table (&disk_inode->indirect, reservation))
+        return false;
+      table = disk_inode->indirect;
+      idx -= NUM_DIRECT_POINTERS;
+    }
+  else
+    {
+      size_t table_idx;
+
+      idx -= INDIRECT_LIMIT + 1;
+      table_idx = idx / NUM_POINTERS_PER_TABLE;
+      idx %= NUM_POINTERS_PER_TABLE;
+      if (disk_inode->doubleindirect == 0
+          && !allocate_table (&disk_inode->doubleindirect, reservation))
+        return false;
+      cache_block_read_chunk (fs_device, disk_inode->doubleindirect, &table,
+                              sizeof table, sizeof table * table_idx);
+      if (table == 0)
+        {
+          if (!allocate_table (&table, reservation))
+            return false;
+          cache_block_write_chunk (fs_device, disk_inode->doubleindirect,
+                                   &table, sizeof table,
+                                   sizeof table * table_idx);
+        }
+    }
+  cache_block_write_chunk (fs_device, table, &sector, sizeof sector,
+                           sizeof sector * idx);
+  return true;
+}
 
-  disk_inode->length = (int32_t)new_size;
-  // write data blocks to disk
-  static char zeros[BLOCK_SECTOR_SIZE];
+/* Returns the number of data sectors allocated to DISK_INODE.
+   Allocated sectors always form a prefix of the file, which may
+   reach past the sectors its length requires if space was
+   reserved with inode_allocate(). */
+static size_t
+allocated_sectors (const struct inode_disk *disk_inode)
+{
+  size_t lo = bytes_to_sectors (disk_inode->length);
+  size_t hi = MAX_DATA_SECTORS;
 
-  struct inode_disk_pointer_table *indirect_table = NULL;
+  /* Binary search for the end of the prefix. */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (get_data_sector (disk_inode, mid) != 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
 
-  struct inode_disk_pointer_table
-          *double_indirect_tables[MAX_DOUBLE_INDIRECT_TABLES] = {0};
-  struct inode_disk_pointer_table *double_indirect_table_of_tables = NULL;
-  bool has_modified_double_indirect_tables = false;
+/* Makes sure that the first SECTOR_CNT data sectors of
+   DISK_INODE are allocated.  Missing sectors are allocated in
+   runs of consecutive sectors, so the free map is written once
+   per run instead of once per sector.  New sectors are not
+   initialized.  On failure, the sectors allocated so far stay
+   reserved past the end of file.  If RESERVATION is non-null,
+   the sectors are drawn from the *RESERVATION sectors the caller
+   holds from free_map_reserve() first. */
+static bool
+inode_disk_reserve (struct inode_disk *disk_inode, size_t sector_cnt,
+                    size_t *reservation)
+{
+  size_t cnt = allocated_sectors (disk_inode);
+  size_t needed, own;
+
+  if (sector_cnt > MAX_DATA_SECTORS)
+    return false;
+  if (cnt >= sector_cnt)
+    return true;
+
+  needed = required_sectors_for_data_sectors (sector_cnt)
+           - required_sectors_for_data_sectors (cnt);
+  own = reservation != NULL ? *reservation : 0;
+  needed = needed > own ? needed - own : 0;
+  if (!free_map_has_enough_space (needed))
+    {
+      /* Blocks of removed files may still be waiting to be freed. */
+      inode_reclaim_wait ();
+      if (!free_map_has_enough_space (needed))
+        return false;
+    }
 
-  for (uint32_t i = old_sector_num; i < new_sector_num; i++)
-  {
-    block_sector_t current_sector;
-    if (!free_map_allocate (1, &current_sector))
+  while (cnt < sector_cnt)
     {
-      ASSERT(0);
+      size_t run = sector_cnt - cnt;
+      block_sector_t first;
+      size_t charged, i;
+
+      /* Take the longest run the free map can provide. */
+      own = reservation != NULL ? *reservation : 0;
+      while (!free_map_allocate_reserved (run, &first, reservation))
+        {
+          if (run == 1)
+            return false;
+          run /= 2;
+        }
+      charged = reservation != NULL ? own - *reservation : 0;
+
+      for (i = 0; i < run; i++, cnt++)
+        if (!set_data_sector (disk_inode, cnt, first + i, reservation))
+          {
+            /* The unused sectors are still needed for the data
+               they were meant for, so their share of the
+               reservation goes back. */
+            if (reservation != NULL)
+              free_map_release_reserved (first + i, run - i,
+                                         charged < run - i
+                                         ? charged : run - i,
+                                         reservation);
+            else
+              free_map_release (first + i, run - i);
+            return false;
+          }
     }
-    // write data
-    cache_block_write (fs_device, current_sector, zeros);
+  return true;
+}
 
-	// write tables and references
-	if (i < NUM_DIRECT_POINTERS)
-	{
-	  ASSERT(disk_inode->direct[i] == 0);
-	  disk_inode->direct[i] = current_sector;
-	}
-	else if (i <= INDIRECT_LIMIT)
-	{
-	  if (indirect_table == NULL)
-	  {
-		indirect_table = calloc(1, sizeof(struct inode_disk_pointer_table));
-		ASSERT(indirect_table != NULL);
-		// check if we already have table on disk
-		if (disk_inode->indirect != 0)
-		{
-		  cache_block_read(fs_device, disk_inode->indirect, indirect_table);
-		}
-	  }
-	  indirect_table->pointers[i - NUM_DIRECT_POINTERS] = current_sector;
-	}
-	else
-	{
-	  uint32_t table_id = (i - INDIRECT_LIMIT - 1) / NUM_POINTERS_PER_TABLE;
-	  uint32_t in_table_index = (i - INDIRECT_LIMIT - 1) %
-								NUM_POINTERS_PER_TABLE;
-
-      has_modified_double_indirect_tables = true;
-
-	  // check if we already have table of tables on disk
-	  if (double_indirect_table_of_tables == NULL &&
-	  disk_inode->doubleindirect != 0)
-	  {
-		double_indirect_table_of_tables = calloc(1, sizeof(struct
-				inode_disk_pointer_table));
-		ASSERT(double_indirect_table_of_tables != NULL);
-		cache_block_read(fs_device, disk_inode->doubleindirect,
-						 double_indirect_table_of_tables);
-	  }
-
-	  if (double_indirect_tables[table_id] == NULL)
-	  {
-		double_indirect_tables[table_id] = calloc(1, sizeof(struct
-				inode_disk_pointer_table));
-		ASSERT(double_indirect_tables[table_id] != NULL);
-		// check if we already have this table on disk
-		if (double_indirect_table_of_tables != NULL &&
-		double_indirect_table_of_tables->pointers[table_id] != 0)
-		{
-		  cache_block_read(fs_device, double_indirect_table_of_tables->pointers[table_id],
-						   double_indirect_tables[table_id]);
-		}
-	  }
-
-      double_indirect_tables[table_id]->pointers[in_table_index] =
-              current_sector;
+/* Extends DISK_INODE to NEW_SIZE bytes.  Data sectors that become
+   part of the file are filled with zeros.  Writing DISK_INODE
+   itself to disk is left to the caller. */
+static bool
+inode_disk_extend (struct inode_disk *disk_inode, uint32_t new_size)
+{
+  size_t old_cnt, new_cnt, i;
+
+  ASSERT (disk_inode != NULL);
+  ASSERT (new_size > (uint32_t) disk_inode->length);
+
+  old_cnt = bytes_to_sectors (disk_inode->length);
+  new_cnt = bytes_to_sectors ((off_t) new_size);
+  if (!inode_disk_reserve (disk_inode, new_cnt, NULL))
+    return false;
+
+  /* Sectors reserved earlier may hold stale data. */
+  for (i = old_cnt; i < new_cnt; i++)
+    cache_block_write (fs_device, get_data_sector (disk_inode, i), zeros);
+
+  disk_inode->length = (off_t) new_size;
+  return true;
+}
+
+/* Extends INODE to NEW_SIZE bytes right away, allocating and
+   zeroing disk sectors and writing the inode. */
+static bool
+extend_now (struct inode *inode, off_t new_size)
+{
+  size_t new_cnt = bytes_to_sectors (new_size);
+
+  if (!inode_disk_extend (&inode->data, new_size))
+    return false;
+  cache_block_write (fs_device, inode->sector, &inode->data);
+  inode->length = inode->data.length;
+  if (inode->allocated < new_cnt)
+    inode->allocated = new_cnt;
+  return true;
+}
+
+/* Returns the number of free map sectors that must be reserved
+   so that INODE can be flushed once it is NEW_CNT sectors long. */
+static size_t
+delalloc_needed (const struct inode *inode, size_t new_cnt)
+{
+  if (new_cnt <= inode->allocated)
+    return 0;
+  return required_sectors_for_data_sectors (new_cnt)
+         - required_sectors_for_data_sectors (inode->allocated);
+}
+
+/* Extends regular file INODE to NEW_SIZE bytes without touching
+   the disk.  Everything from the sector that holds the current
+   end of file on is buffered until inode_flush_delalloc().
+   Enough free map sectors are reserved to make sure the flush
+   cannot run out of space. */
+static bool
+delalloc_extend (struct inode *inode, off_t new_size)
+{
+  size_t new_cnt = bytes_to_sectors (new_size);
+  size_t needed;
+
+  if (inode->delalloc != NULL
+      && new_cnt - inode->delalloc_first > DELALLOC_SECTORS)
+    {
+      /* The buffer is full.  Write it out and start over. */
+      if (!inode_flush_delalloc (inode, true))
+        return false;
     }
-  }
 
+  if (inode->delalloc == NULL)
+    {
+      size_t first = inode->data.length / BLOCK_SECTOR_SIZE;
+
+      /* Don't buffer growth by more than the buffer holds. */
+      if (new_cnt - first > DELALLOC_SECTORS)
+        return extend_now (inode, new_size);
+
+      inode->delalloc = calloc (DELALLOC_SECTORS, BLOCK_SECTOR_SIZE);
+      if (inode->delalloc == NULL)
+        return extend_now (inode, new_size);
+      inode->delalloc_first = first;
+      inode->delalloc_reserved = 0;
+
+      /* The sector holding the end of file is buffered too, so
+         appends never touch the disk. */
+      if (inode->data.length % BLOCK_SECTOR_SIZE != 0)
+        cache_block_read_chunk (fs_device,
+                                get_data_sector (&inode->data, first),
+                                inode->delalloc,
+                                inode->data.length % BLOCK_SECTOR_SIZE, 0);
+    }
 
-  // write all kinds of tables to disk
+  needed = delalloc_needed (inode, new_cnt) - inode->delalloc_reserved;
+  if (needed > 0 && !free_map_reserve (needed))
+    {
+      /* Blocks of removed files may still be waiting to be freed. */
+      inode_reclaim_wait ();
+      if (!free_map_reserve (needed))
+        return false;
+    }
+  inode->delalloc_reserved += needed;
+  inode->length = new_size;
+  return true;
+}
+
+bool inode_extend(struct inode *i, uint32_t new_size)
+{
+  bool success = true;
 
-  if (has_modified_double_indirect_tables && double_indirect_table_of_tables == NULL)
+  lock_acquire(&i->extend_lock);
+  if ((off_t) new_size > i->length)
   {
-	double_indirect_table_of_tables = calloc(1, sizeof(struct
-			inode_disk_pointer_table));
-	ASSERT(double_indirect_table_of_tables != NULL);
+    if (inode_is_directory (i))
+      success = extend_now (i, new_size);
+    else
+      success = delalloc_extend (i, new_size);
   }
+  lock_release(&i->extend_lock);
+  return success;
+}
 
-  // write double indirect tables to disk
-  for (uint32_t idx = 0; idx < (sizeof(double_indirect_tables)) / (sizeof(
-  double_indirect_tables[0])); idx++)
-  {
-    if (double_indirect_tables[idx] == NULL) continue;
+/* If OFFSET in INODE lies in data buffered for delayed
+   allocation, copies SIZE bytes between BUFFER and the delayed
+   allocation buffer, in the direction given by WRITE, and
+   returns true.  Otherwise, that is if OFFSET has a disk sector,
+   returns false without copying. */
+static bool
+delalloc_access (struct inode *inode, off_t offset, void *buffer, int size,
+                 bool write)
+{
+  bool buffered;
 
-    block_sector_t double_indirect_table_sector = 0;
-    if (double_indirect_table_of_tables != NULL)
-      double_indirect_table_sector =
-              double_indirect_table_of_tables->pointers[idx];
+  if (inode->delalloc == NULL
+      || offset < (off_t) (inode->delalloc_first * BLOCK_SECTOR_SIZE))
+    return false;
 
-    if (double_indirect_table_sector == 0
-      && !free_map_allocate (1, &double_indirect_table_sector))
+  lock_acquire (&inode->extend_lock);
+  buffered = delalloc_copy (inode, offset, buffer, size, write);
+  lock_release (&inode->extend_lock);
+  return buffered;
+}
+
+/* Like delalloc_access(), but INODE's extend_lock must be held. */
+static bool
+delalloc_copy (struct inode *inode, off_t offset, void *buffer, int size,
+               bool write)
+{
+  off_t start;
+  uint8_t *p;
+
+  ASSERT (lock_held_by_current_thread (&inode->extend_lock));
+
+  start = inode->delalloc_first * BLOCK_SECTOR_SIZE;
+  if (inode->delalloc == NULL || offset < start)
+    return false;
+  p = inode->delalloc + (offset - start);
+  if (write)
+    memcpy (p, buffer, size);
+  else
+    memcpy (buffer, p, size);
+  return true;
+}
+
+/* Writes out the data INODE buffers for delayed allocation and
+   then the inode.  Missing disk sectors are allocated in one run
+   of consecutive sectors if the free map allows.  If SPECULATE
+   is true, that run also covers extra sectors past the end of
+   file for the file to grow into, up to PREALLOC_MAX_SECTORS.
+   INODE's extend_lock must be held, unless INODE has no other
+   users. */
+static bool
+inode_flush_delalloc (struct inode *inode, bool speculate)
+{
+  size_t cnt, extra, allocated, i;
+
+  if (inode->delalloc == NULL)
+    return true;
+
+  cnt = bytes_to_sectors (inode->length);
+  extra = 0;
+  if (speculate && cnt > inode->allocated)
     {
-      ASSERT(0);
+      extra = cnt < PREALLOC_MAX_SECTORS ? cnt : PREALLOC_MAX_SECTORS;
+      if (cnt + extra > MAX_DATA_SECTORS)
+        extra = MAX_DATA_SECTORS - cnt;
     }
-    cache_block_write (fs_device, double_indirect_table_sector,
-                       double_indirect_tables[idx]);
-    double_indirect_table_of_tables->pointers[idx] =
-            double_indirect_table_sector;
-  }
 
-  // write table of tables to disk
-  if (has_modified_double_indirect_tables)
-  {
-    block_sector_t double_indirect_table_of_tables_sector = disk_inode->doubleindirect;
-    if (double_indirect_table_of_tables_sector == 0
-    && !free_map_allocate(1, &double_indirect_table_of_tables_sector))
+  /* The sectors come out of the reservation first, so nobody
+     else can have taken them in the meantime. */
+  if (extra > 0
+      && (!free_map_has_enough_space (4 * extra)
+          || !inode_disk_reserve (&inode->data, cnt + extra,
+                                  &inode->delalloc_reserved)))
+    extra = 0;
+  if (extra == 0 && !inode_disk_reserve (&inode->data, cnt,
+                                         &inode->delalloc_reserved))
+    return false;
+  free_map_unreserve (inode->delalloc_reserved);
+  inode->delalloc_reserved = 0;
+  allocated = allocated_sectors (&inode->data);
+  if (allocated > inode->allocated)
     {
-      ASSERT(0);
+      inode->allocated = allocated;
+      inode->prealloc_first = cnt;
     }
-    cache_block_write(fs_device, double_indirect_table_of_tables_sector,
-                      double_indirect_table_of_tables);
-    disk_inode->doubleindirect = double_indirect_table_of_tables_sector;
-  }
 
-  // write indirect table
-  if (indirect_table != NULL)
+  for (i = inode->delalloc_first; i < cnt; i++)
+    cache_block_write (fs_device, get_data_sector (&inode->data, i),
+                       inode->delalloc
+                       + (i - inode->delalloc_first) * BLOCK_SECTOR_SIZE);
+  inode->data.length = inode->length;
+  cache_block_write (fs_device, inode->sector, &inode->data);
+
+  free (inode->delalloc);
+  inode->delalloc = NULL;
+  return true;
+}
+
+/* Allocates disk sectors for and writes out the data of every
+   open inode that is waiting for delayed allocation. */
+void
+inode_flush_all (void)
+{
+  struct list_elem *e;
+
+  lock_acquire (&open_inodes_lock);
+  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+       e = list_next (e))
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+
+      if (inode->delalloc == NULL)
+        continue;
+      lock_acquire (&inode->extend_lock);
+      inode_flush_delalloc (inode, true);
+      lock_release (&inode->extend_lock);
+    }
+  lock_release (&open_inodes_lock);
+}
+/* Queues removed INODE, which has no openers left, for the
+   reclaimer thread. */
+static void
+reclaim_enqueue (struct inode *inode)
+{
+  lock_acquire (&reclaim_lock);
+  list_push_back (&reclaim_queue, &inode->elem);
+  reclaim_pending++;
+  cond_signal (&reclaim_ready, &reclaim_lock);
+  lock_release (&reclaim_lock);
+}
+
+/* Collects sectors to free and releases them in batches. */
+struct reclaim_batch
   {
-    block_sector_t indirect_table_sector = disk_inode->indirect;
-    if (indirect_table_sector == 0
-    && !free_map_allocate (1, &indirect_table_sector))
+    block_sector_t sectors[RECLAIM_BATCH];
+    size_t cnt;
+  };
+
+/* Releases all sectors collected in BATCH. */
+static void
+reclaim_flush (struct reclaim_batch *batch)
+{
+  free_map_release_multiple (batch->sectors, batch->cnt);
+  batch->cnt = 0;
+}
+
+/* Adds SECTOR to BATCH, releasing the batch if it is full.
+   Sector 0 marks an unused pointer and is ignored. */
+static void
+reclaim_add (struct reclaim_batch *batch, block_sector_t sector)
+{
+  if (sector == 0)
+    return;
+  if (batch->cnt == RECLAIM_BATCH)
+    reclaim_flush (batch);
+  batch->sectors[batch->cnt++] = sector;
+}
+
+/* Adds every sector referenced by removed INODE, including its
+   pointer tables and the inode sector itself, to BATCH. */
+static void
+reclaim_inode (struct reclaim_batch *batch, struct inode *inode)
+{
+  struct inode_disk_pointer_table *tables;
+  uint32_t i, j;
+
+  for (i = 0; i < NUM_DIRECT_POINTERS; i++)
+    reclaim_add (batch, inode->data.direct[i]);
+
+  /* TABLES[0] holds a table of data sectors or the table of
+     tables, TABLES[1] a table under the table of tables. */
+  tables = malloc (2 * sizeof *tables);
+  if (tables == NULL)
+    PANIC ("fs-reclaim: out of memory");
+
+  if (inode->data.indirect != 0)
     {
-      ASSERT(0);
+      cache_block_read (fs_device, inode->data.indirect, &tables[0]);
+      for (i = 0; i < NUM_POINTERS_PER_TABLE; i++)
+        reclaim_add (batch, tables[0].pointers[i]);
+      reclaim_add (batch, inode->data.indirect);
     }
-    cache_block_write (fs_device, indirect_table_sector, indirect_table);
-    disk_inode->indirect = indirect_table_sector;
-  }
 
-  // writing inode to disk is left to the caller
+  if (inode->data.doubleindirect != 0)
+    {
+      cache_block_read (fs_device, inode->data.doubleindirect, &tables[0]);
+      for (i = 0; i < NUM_POINTERS_PER_TABLE; i++)
+        {
+          if (tables[0].pointers[i] == 0)
+            continue;
+          cache_block_read (fs_device, tables[0].pointers[i], &tables[1]);
+          for (j = 0; j < NUM_POINTERS_PER_TABLE; j++)
+            reclaim_add (batch, tables[1].pointers[j]);
+          reclaim_add (batch, tables[0].pointers[i]);
+        }
+      reclaim_add (batch, inode->data.doubleindirect);
+    }
+
+  reclaim_add (batch, inode->sector);
+  free (tables);
+}
+
+/* Reclaimer thread.  Frees the blocks of every inode on
+   reclaim_queue, batching the free map updates of all inodes
+   queued at the same time. */
+static void
+reclaim_thread (void *aux UNUSED)
+{
+  struct reclaim_batch *batch = malloc (sizeof *batch);
+  if (batch == NULL)
+    PANIC ("fs-reclaim: out of memory");
+  batch->cnt = 0;
+
+  for (;;)
+    {
+      struct inode *inode;
+      int cnt = 0;
 
+      lock_acquire (&reclaim_lock);
+      while (list_empty (&reclaim_queue))
+        cond_wait (&reclaim_ready, &reclaim_lock);
+      while (!list_empty (&reclaim_queue))
+        {
+          inode = list_entry (list_pop_front (&reclaim_queue),
+                              struct inode, elem);
+          lock_release (&reclaim_lock);
+
+          reclaim_inode (batch, inode);
+          free (inode);
+          cnt++;
+
+          lock_acquire (&reclaim_lock);
+        }
+      lock_release (&reclaim_lock);
+
+      reclaim_flush (batch);
+
+      lock_acquire (&reclaim_lock);
+      reclaim_pending -= cnt;
+      if (reclaim_pending == 0)
+        cond_broadcast (&reclaim_idle, &reclaim_lock);
+      lock_release (&reclaim_lock);
+    }
+}
+
+/* Waits until the blocks of all removed inodes closed so far
+   have been returned to the free map. */
+void
+inode_reclaim_wait (void)
+{
+  lock_acquire (&reclaim_lock);
+  while (reclaim_pending > 0)
+    cond_wait (&reclaim_idle, &reclaim_lock);
+  lock_release (&reclaim_lock);
+}
+
+/* Writes zeros over pointers FIRST and up of pointer table
+   SECTOR. */
+static void
+clear_table_tail (block_sector_t sector, size_t first)
+{
+  if (first < NUM_POINTERS_PER_TABLE)
+    cache_block_write_chunk (fs_device, sector, zeros,
+                             (NUM_POINTERS_PER_TABLE - first)
+                             * sizeof (block_sector_t),
+                             first * sizeof (block_sector_t));
+}
+
+/* Frees every data sector of DISK_INODE from KEEP on, and the
+   pointer tables that are no longer needed.  The sectors are
+   returned to the free map in batches.  Writing DISK_INODE
+   itself to disk is left to the caller. */
+static bool
+inode_disk_trim (struct inode_disk *disk_inode, size_t keep)
+{
+  size_t cnt = allocated_sectors (disk_inode);
+  struct reclaim_batch *batch;
+  size_t i;
+
+  if (cnt <= keep)
+    return true;
+
+  batch = malloc (sizeof *batch);
+  if (batch == NULL)
+    return false;
+  batch->cnt = 0;
+
+  for (i = keep; i < cnt; i++)
+    reclaim_add (batch, get_data_sector (disk_inode, i));
+  for (i = keep; i < NUM_DIRECT_POINTERS; i++)
+    disk_inode->direct[i] = 0;
+
+  if (disk_inode->indirect != 0)
+    {
+      if (keep <= NUM_DIRECT_POINTERS)
+        {
+          reclaim_add (batch, disk_inode->indirect);
+          disk_inode->indirect = 0;
+        }
+      else
+        clear_table_tail (disk_inode->indirect, keep - NUM_DIRECT_POINTERS);
+    }
+
+  if (disk_inode->doubleindirect != 0)
+    {
+      /* Number of data sectors kept under the table of tables. */
+      size_t kept = keep > INDIRECT_LIMIT ? keep - INDIRECT_LIMIT - 1 : 0;
+      size_t kept_tables = DIV_ROUND_UP (kept, NUM_POINTERS_PER_TABLE);
+      block_sector_t table;
+
+      for (i = kept_tables; i < MAX_DOUBLE_INDIRECT_TABLES; i++)
+        {
+          cache_block_read_chunk (fs_device, disk_inode->doubleindirect,
+                                  &table, sizeof table, sizeof table * i);
+          if (table == 0)
+            break;
+          reclaim_add (batch, table);
+        }
+
+      if (kept == 0)
+        {
+          reclaim_add (batch, disk_inode->doubleindirect);
+          disk_inode->doubleindirect = 0;
+        }
+      else
+        {
+          clear_table_tail (disk_inode->doubleindirect, kept_tables);
+          if (kept % NUM_POINTERS_PER_TABLE != 0)
+            {
+              cache_block_read_chunk (fs_device, disk_inode->doubleindirect,
+                                      &table, sizeof table,
+                                      sizeof table * (kept_tables - 1));
+              clear_table_tail (table, kept % NUM_POINTERS_PER_TABLE);
+            }
+        }
+    }
+
+  reclaim_flush (batch);
+  free (batch);
   return true;
 }
 
-bool inode_extend(struct inode *i, uint32_t new_size)
+/* Shrinks DISK_INODE to LENGTH bytes and frees every data sector
+   and pointer table past the new end of file, including space
+   reserved past the old end of file.  Writing DISK_INODE itself
+   to disk is left to the caller. */
+static bool
+inode_disk_shrink (struct inode_disk *disk_inode, off_t length)
 {
-  lock_acquire(&i->extend_lock);
-  bool success = inode_disk_extend(&i->data, new_size);
+  /* Bytes past the end of file in the last sector must read
+     back as zeros if the file grows again. */
+  if (length % BLOCK_SECTOR_SIZE != 0 && length < disk_inode->length)
+    {
+      int ofs = length % BLOCK_SECTOR_SIZE;
+      cache_block_write_chunk (fs_device,
+                               get_data_sector (disk_inode,
+                                                bytes_to_sectors (length) - 1),
+                               zeros, BLOCK_SECTOR_SIZE - ofs, ofs);
+    }
+  disk_inode->length = length;
+
+  return inode_disk_trim (disk_inode, bytes_to_sectors (length));
+}
+
+/* Frees the sectors allocated speculatively past the end of
+   INODE.  INODE's extend_lock must be held, unless INODE has no
+   other users. */
+static void
+inode_trim_prealloc (struct inode *inode)
+{
+  size_t keep = bytes_to_sectors (inode->data.length);
+
+  if (keep < inode->prealloc_first)
+    keep = inode->prealloc_first;
+  if (keep >= inode->allocated || !inode_disk_trim (&inode->data, keep))
+    return;
+  cache_block_write (fs_device, inode->sector, &inode->data);
+  inode->allocated = inode->prealloc_first = keep;
+}
+
+/* Sets the length of INODE to LENGTH bytes.  Growing the file
+   fills the new bytes with zeros.  Shrinking it frees the sectors
+   past the new end of file.  In both cases space reserved past
+   the end of file with inode_allocate() is released.  Returns
+   true if successful, false if writes to INODE are denied or
+   disk or memory allocation fails. */
+bool
+inode_truncate (struct inode *inode, off_t length)
+{
+  bool success;
+
+  if (length < 0 || inode->deny_write_cnt)
+    return false;
+
+  lock_acquire (&inode->extend_lock);
+  if (!inode_flush_delalloc (inode, false))
+    {
+      /* The buffered data and the length that covers it stay. */
+      lock_release (&inode->extend_lock);
+      return false;
+    }
+  success = true;
+  if (length > inode->data.length)
+    success = inode_disk_extend (&inode->data, length);
   if (success)
-	  cache_block_write (fs_device, i->sector, &i->data);
-  lock_release(&i->extend_lock);
+    success = inode_disk_shrink (&inode->data, length);
+  cache_block_write (fs_device, inode->sector, &inode->data);
+  inode->length = inode->data.length;
+  inode->allocated = inode->prealloc_first
+    = allocated_sectors (&inode->data);
+  lock_release (&inode->extend_lock);
   return success;
-}
\ No newline at end of file
+}
+
+/* Reserves disk space for bytes OFFSET through OFFSET + LENGTH - 1
+   of INODE without changing its length or writing any data.
+   Space past the end of file is allocated in runs of consecutive
+   sectors and becomes part of the file when it grows into it.
+   Returns true if successful, false if the range is invalid or
+   there is not enough space. */
+bool
+inode_allocate (struct inode *inode, off_t offset, off_t length)
+{
+  bool success;
+
+  if (offset < 0 || length <= 0 || offset > INT32_MAX - length)
+    return false;
+
+  lock_acquire (&inode->extend_lock);
+  success = (inode_flush_delalloc (inode, false)
+             && inode_disk_reserve (&inode->data,
+                                    bytes_to_sectors (offset + length),
+                                    NULL));
+  cache_block_write (fs_device, inode->sector, &inode->data);
+
+  /* Explicitly reserved space is never trimmed, even where it
+     covers speculative preallocation. */
+  inode->allocated = allocated_sectors (&inode->data);
+  if (success && inode->prealloc_first < bytes_to_sectors (offset + length))
+    inode->prealloc_first = bytes_to_sectors (offset + length);
+  lock_release (&inode->extend_lock);
+  return success;
+}
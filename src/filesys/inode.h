@@ -23,6 +23,10 @@ off_t inode_length (const struct inode *);
 bool inode_is_directory(struct inode *i);
 block_sector_t inode_get_sector(struct inode *i);
 bool inode_extend(struct inode *i, uint32_t size);
+bool inode_truncate (struct inode *, off_t length);
+bool inode_allocate (struct inode *, off_t offset, off_t length);
 off_t inode_get_length(struct inode *i);
+void inode_reclaim_wait (void);
+void inode_flush_all (void);
 
 #endif /* filesys/inode.h */
@@ -28,7 +28,11 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+    SYS_FTRUNCATE,              /* Sets the length of a file. */
+    SYS_FALLOCATE,              /* Reserves disk space for a file. */
+
+    SYS_FORK                    /* Duplicates the current process. */
   };
 
 #endif /* lib/syscall-nr.h */
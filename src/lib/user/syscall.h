@@ -45,4 +45,11 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* File sizing. */
+bool ftruncate (int fd, unsigned length);
+bool fallocate (int fd, unsigned offset, unsigned length);
+
+/* Process duplication. */
+pid_t fork (void);
+
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({"testfile" => [("y" x 1000) . ("\0" x 11344) . "z"]});
+pass;
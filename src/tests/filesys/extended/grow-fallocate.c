@@ -0,0 +1,36 @@
+/* Reserves space for a file with fallocate(), checks that its
+   length is unchanged, then grows it into the reserved space by
+   seeking past the end and writing, which must zero the region
+   in between.  Finally trims the unused reservation with
+   ftruncate(). */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[12345];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  memset (buf, 'y', 1000);
+  buf[sizeof buf - 1] = 'z';
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (fallocate (fd, 0, 65536), "fallocate \"%s\"", file_name);
+  if (filesize (fd) != 0)
+    fail ("filesize should be 0, actually %d", filesize (fd));
+  CHECK (write (fd, buf, 1000) == 1000, "write \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, sizeof buf - 1);
+  CHECK (write (fd, buf + sizeof buf - 1, 1) == 1,
+         "write \"%s\"", file_name);
+  CHECK (ftruncate (fd, sizeof buf), "trim \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,34 @@
+/* Writes a file, shrinks it with ftruncate(), then grows it
+   again with ftruncate() and checks that the bytes past the old
+   end of file read back as zeros. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[5678];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  memset (buf, 'x', sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf,
+         "write \"%s\"", file_name);
+  CHECK (ftruncate (fd, 1000), "shrink \"%s\"", file_name);
+  if (filesize (fd) != 1000)
+    fail ("filesize should be 1000, actually %d", filesize (fd));
+  CHECK (ftruncate (fd, 3000), "grow \"%s\"", file_name);
+  if (filesize (fd) != 3000)
+    fail ("filesize should be 3000, actually %d", filesize (fd));
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  memset (buf + 1000, 0, 2000);
+  check_file (file_name, buf, 3000);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-truncate) begin
+(grow-truncate) create "testfile"
+(grow-truncate) open "testfile"
+(grow-truncate) write "testfile"
+(grow-truncate) shrink "testfile"
+(grow-truncate) grow "testfile"
+(grow-truncate) close "testfile"
+(grow-truncate) open "testfile" for verification
+(grow-truncate) verified contents of "testfile"
+(grow-truncate) close "testfile"
+(grow-truncate) end
+EOF
+pass;
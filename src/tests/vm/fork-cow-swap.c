@@ -0,0 +1,58 @@
+/* Forks with 2 MB of data, more than fits in memory once the
+   child has its own copy, so that shared pages and both copies
+   are evicted.  The child checks it sees the parent's data, then
+   overwrites it and reads its copy back, and the parent verifies
+   that its copy is left unchanged. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (2 * 1024 * 1024)
+
+static char buf[SIZE];
+
+/* Differs between pages, so a page swapped back into the wrong
+   place is noticed. */
+static char
+pattern (size_t i)
+{
+  return (i / 4096 * 7 + i) % 251;
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t i;
+
+  msg ("initialize");
+  for (i = 0; i < SIZE; i++)
+    buf[i] = pattern (i);
+
+  msg ("fork");
+  child = fork ();
+  if (child == 0)
+    {
+      /* Child: quietly, its output would race with the parent's. */
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != pattern (i))
+          exit (1);
+      for (i = 0; i < SIZE; i++)
+        buf[i] = ~pattern (i);
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != (char) ~pattern (i))
+          exit (2);
+      exit (81);
+    }
+  if (child == -1)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 81, "wait for child");
+
+  msg ("read pass");
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != pattern (i))
+      fail ("byte %zu changed by child", i);
+}
@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-cow-swap) begin
+(fork-cow-swap) initialize
+(fork-cow-swap) fork
+(fork-cow-swap) wait for child
+(fork-cow-swap) read pass
+(fork-cow-swap) end
+EOF
+pass;
@@ -0,0 +1,53 @@
+/* Forks a child that checks it sees the parent's data, then
+   overwrites it, and verifies that the parent's copy is left
+   unchanged. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (128 * 1024)
+
+static char buf[SIZE];
+
+static char
+pattern (size_t i)
+{
+  return i % 251;
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t i;
+
+  msg ("initialize");
+  for (i = 0; i < SIZE; i++)
+    buf[i] = pattern (i);
+
+  msg ("fork");
+  child = fork ();
+  if (child == 0)
+    {
+      /* Child: quietly, its output would race with the parent's. */
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != pattern (i))
+          exit (1);
+      memset (buf, 0x5a, SIZE);
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != 0x5a)
+          exit (2);
+      exit (81);
+    }
+  if (child == -1)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 81, "wait for child");
+
+  msg ("read pass");
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != pattern (i))
+      fail ("byte %zu changed by child", i);
+}
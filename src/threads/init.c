@@ -11,6 +11,7 @@
 #include "vm/frame.h"
 #include "vm/page.h"
 #include "vm/swap.h"
+#include "vm/writeback.h"
 #include "devices/kbd.h"
 #include "devices/input.h"
 #include "devices/serial.h"
@@ -37,6 +38,10 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/shape.h"
+#include "devices/stripe.h"
+#include "devices/virtio-blk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #include "filesys/cache.h"
@@ -55,7 +60,21 @@ static const char *filesys_bdev_name;
 static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
+
+/* -zswap: Kernel pages set aside for compressed swap, 0 for none. */
+static size_t zswap_pages;
 #endif
+
+/* -ramdisk: Size of the RAM disk in MB, 0 for none. */
+static size_t ramdisk_mb;
+
+/* -stripe, -stripe-chunk: Members of the striped device md0, if
+   any, and its chunk size in sectors (0 for the default). */
+static char *stripe_members;
+static size_t stripe_chunk;
+
+/* -shape: Device to wrap in shape0 and how to shape it, if any. */
+static char *shape_spec;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -67,6 +86,9 @@ static void paging_init (void);
 static char **read_command_line (void);
 static char **parse_options (char **argv);
 static void run_actions (char **argv);
+#ifdef FILESYS
+static void print_iostat (char **argv);
+#endif
 static void usage (void);
 
 #ifdef FILESYS
@@ -129,11 +151,19 @@ kernel_main (void)
 #ifdef FILESYS
   /* Initialize file system. */
   ide_init ();
+  virtio_blk_init ();
+  ramdisk_init (ramdisk_mb);
+  if (stripe_members != NULL)
+    stripe_init (stripe_members, stripe_chunk);
+  if (shape_spec != NULL)
+    shape_init (shape_spec);
   locate_block_devices ();
   init_cache();
   filesys_init (format_filesys);
 #endif
-  swap_init();
+  swap_init(zswap_pages);
+  frame_pageout_init();
+  writeback_init();
   printf ("Boot complete.\n");
   
   /* Run actions specified on kernel command line. */
@@ -256,9 +286,21 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_mb = atoi (value);
+      else if (!strcmp (name, "-stripe"))
+        stripe_members = value;
+      else if (!strcmp (name, "-stripe-chunk"))
+        stripe_chunk = atoi (value);
+      else if (!strcmp (name, "-shape"))
+        shape_spec = value;
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
+      else if (!strcmp (name, "-zswap"))
+        zswap_pages = atoi (value);
+      else if (!strcmp (name, "-swappiness"))
+        frame_set_swappiness (atoi (value));
 #endif
 #endif
       else if (!strcmp (name, "-rs"))
@@ -301,6 +343,15 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+#ifdef FILESYS
+/* Prints block device I/O statistics gathered so far. */
+static void
+print_iostat (char **argv UNUSED)
+{
+  block_print_stats ();
+}
+#endif
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -324,6 +375,7 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"iostat", 1, print_iostat},
 #endif
       {NULL, 0, NULL},
     };
@@ -373,6 +425,7 @@ usage (void)
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
+          "  iostat             Print block device I/O statistics.\n"
 #endif
           "\nOptions:\n"
           "  -h                 Print this help message and power off.\n"
@@ -382,8 +435,17 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -ramdisk=MB        Create RAM disk ram0 of MB megabytes.\n"
+          "  -stripe=BDEV,...   Create md0 striped across the given BDEVs.\n"
+          "  -stripe-chunk=N    Use N-sector chunks for md0 (default 16).\n"
+          "  -shape=BDEV[,lat=US][,bw=KB][,fail=N][,drop=N]\n"
+          "                     Create shape0, a slowed-down or failing BDEV.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
+          "  -zswap=PAGES       Keep up to PAGES pages of compressed swap\n"
+          "                     in memory (default 0, disabled).\n"
+          "  -swappiness=N      Reclaim anonymous vs. file pages in the ratio\n"
+          "                     N to 200-N (default 60).\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
@@ -7,6 +7,7 @@
 #include <threads/palloc.h>
 #include <filesys/file.h>
 #include <vm/swap.h>
+#include <vm/writeback.h>
 #include "userprog/gdt.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -19,6 +20,7 @@ static long long page_fault_cnt;
 
 static void kill (struct intr_frame *);
 static void page_fault (struct intr_frame *);
+static void swap_in_around (struct thread *, struct spt_entry *, void *);
 
 /* Registers handlers for interrupts that can be caused by user
    programs.
@@ -162,13 +164,24 @@ page_fault (struct intr_frame *f)
   struct thread *t = thread_current();
   bool is_syscall = t->user_esp != NULL && !user;
 
+  uint32_t page_vaddr = (uint32_t)fault_addr / PGSIZE * PGSIZE;
+
   if ((user || is_syscall) && !not_present)
   {
+    // a write to a page shared with a forked process copies it
+    if (write && is_user_vaddr(fault_addr))
+    {
+      frametable_lock();
+      struct spt_entry *se = spt_get_entry(t, page_vaddr, t->tid);
+      bool copied = se != NULL && frame_cow_break(t, se);
+      frametable_unlock();
+      if (copied)
+        return;
+    }
     // user or kernel (might be syscall) tried to write to RO page
     process_terminate(t, -1, t->program_name);
   }
 
-  uint32_t page_vaddr = (uint32_t)fault_addr / PGSIZE * PGSIZE;
   d_printf("v addr %p\n", (void *) page_vaddr);
 
   frametable_lock();
@@ -206,9 +219,20 @@ page_fault (struct intr_frame *f)
 
   if (spt_entry != NULL) {
     // SPT entry but no mapping in page table exists yet
+    // executable text another process has loaded already is shared
+    if (frame_map_shared(t, spt_entry)) {
+      frametable_unlock();
+      return;
+    }
     frametable_unlock();
     void *frame_pointer = allocate_frame(t, PAL_ZERO, page_vaddr);
     frametable_lock();
+    // someone else may have loaded it while we were allocating
+    if (frame_map_shared(t, spt_entry)) {
+      free_frame(frame_pointer);
+      frametable_unlock();
+      return;
+    }
 
     ASSERT(frame_pointer != NULL);
     ASSERT(page_vaddr != 0);
@@ -222,11 +246,16 @@ page_fault (struct intr_frame *f)
     if (spt_entry->spe_status == mapped_file || spt_entry->spe_status == mapped_file_nowriteback) {
       d_printf("m_file %p \n", (void *) spt_entry->vaddr);
       set_pinned(frame_pointer);
+      // an earlier eviction of this page may still be on its way out
+      writeback_wait(file_get_inode(spt_entry->file),
+                     (off_t)spt_entry->file_offset,
+                     (off_t)spt_entry->read_bytes);
       // read contents from file into newly allocated frame
       file_seek(spt_entry->file, (int)spt_entry->file_offset);
       // this may block and run another thread in the meantime
       file_read(spt_entry->file, frame_pointer, (int)spt_entry->read_bytes);
 
+      frame_share(t, spt_entry, frame_pointer);
       spt_entry->spe_status = spt_entry->spe_status ==
               mapped_file_nowriteback ? frame : frame_from_file;
 
@@ -243,13 +272,10 @@ page_fault (struct intr_frame *f)
     else if (spt_entry->spe_status == swap)
     {
       // read in from swap
-      size_t swap_slot = spt_entry->swap_slot;
 //      printf("swapping in from slot %u to user vaddr %p of process "
 //             "\"%s\" at frame %p\n",
-//             swap_slot, (void*)page_vaddr, t->name, frame_pointer);
-      swap_to_frame(spt_entry->swap_slot, frame_pointer);
-      spt_entry->swap_slot = 0;
-      spt_entry->spe_status = frame;
+//             spt_entry->swap_slot, (void*)page_vaddr, t->name, frame_pointer);
+      swap_in_around(t, spt_entry, frame_pointer);
     }
     else {
       printf("Tried to read from page %p (process \"%s\") %p\n", (void*)
@@ -290,3 +316,49 @@ page_fault (struct intr_frame *f)
   kill (f);
 }
 
+/* Reads the page of SPT_ENTRY back from swap into KPAGE, which is
+   already mapped for it.  Programs tend to fault a swapped-out
+   region back in front to back, so up to SWAP_CLUSTER - 1 of the
+   following pages of T are read in the same transfer and mapped as
+   well, as long as they sit in the following swap slots and free
+   frames are plentiful.  Called with the frame table lock held. */
+static void
+swap_in_around (struct thread *t, struct spt_entry *spt_entry, void *kpage)
+{
+  size_t slot = spt_entry->swap_slot;
+  struct spt_entry *entries[SWAP_CLUSTER];
+  void *frames[SWAP_CLUSTER];
+  size_t cnt;
+
+  entries[0] = spt_entry;
+  frames[0] = kpage;
+  for (cnt = 1; cnt < SWAP_CLUSTER; cnt++)
+    {
+      uint32_t vaddr = spt_entry->vaddr + cnt * PGSIZE;
+      if (vaddr >= (uint32_t) PHYS_BASE)
+        break;
+
+      struct spt_entry *e = spt_get_entry (t, vaddr, t->tid);
+      if (e == NULL || e->spe_status != swap || e->swap_slot != slot + cnt)
+        break;
+
+      void *f = allocate_frame_if_free (t, vaddr);
+      if (f == NULL)
+        break;
+
+      entries[cnt] = e;
+      frames[cnt] = f;
+    }
+
+  bool kept[SWAP_CLUSTER];
+  swap_to_frames (slot, frames, cnt, kept);
+
+  for (size_t i = 0; i < cnt; i++)
+    {
+      if (i > 0 && !pagedir_set_page (t->pagedir, (void *) entries[i]->vaddr,
+                                      frames[i], entries[i]->writable))
+        PANIC ("out of memory mapping swapped-in page");
+      entries[i]->swap_slot = kept[i] ? slot + i : SWAP_SLOT_NONE;
+      entries[i]->spe_status = frame;
+    }
+}
@@ -22,12 +22,15 @@
 #include "threads/vaddr.h"
 #include "threads/synch.h"
 #include "vm/frame.h"
+#include "vm/writeback.h"
 #include "syscall.h"
 
 static thread_func start_process NO_RETURN;
+static thread_func start_fork NO_RETURN;
 
 static bool load(const char *file_name, void (**eip)(void), void **esp,
                  const char *arg_line);
+static void finish_load(bool success, struct semaphore *loaded);
 
 
 #define NUM_ARGS_LIMIT 32
@@ -98,6 +101,22 @@ start_process(void *cmdline_ptr) {
   palloc_free_page(file_name);
 
 
+  finish_load(success, &thread_current()->process_load_sema);
+
+  /* Start the user process by simulating a return from an
+     interrupt, implemented by intr_exit (in
+     threads/intr-stubs.S).  Because intr_exit takes all of its
+     arguments on the stack in the form of a `struct intr_frame',
+     we just point the stack pointer (%esp) to our stack frame
+     and jump to it. */
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
+/* Tells the parent, waiting in exec or fork on LOADED, whether the
+   current process could be set up, and terminates it if not. */
+static void
+finish_load(bool success, struct semaphore *loaded) {
   /*If load failed, note result in parent list*/
   if (!success)
   {
@@ -114,7 +133,7 @@ start_process(void *cmdline_ptr) {
   }
 
   // wake up a thread possibly waiting for our startup
-  sema_up(&thread_current()->process_load_sema);
+  sema_up(loaded);
 
   /* If load failed, quit. */
   if (!success)
@@ -122,14 +141,191 @@ start_process(void *cmdline_ptr) {
     process_terminate(thread_current(), -1, thread_current()
     ->program_name);
   }
+}
 
+/* What a forked process starts from.  NAME comes first, as thread
+   creation takes the program name from the start of its argument. */
+struct fork_arguments {
+    char name[PROGRAM_NAME_SIZE_LIMIT];
+    struct thread *parent;
+    struct intr_frame if_;          /* Parent's state at the fork call. */
+    struct semaphore ready;         /* Up once the parent tracks us. */
+    struct semaphore loaded;        /* Up once we have copied it. */
+};
+
+/* Starts a copy of the current process, which is in the fork system
+   call with user state F, and registers CR for it with the current
+   process.  The child's memory is shared copy-on-write, see
+   spt_fork().  Returns the new process's thread id, or TID_ERROR if
+   the thread cannot be created, once the child has copied the
+   current process or failed to.  In the latter case CR is marked
+   as having failed to load, as for exec. */
+tid_t
+process_fork(const struct intr_frame *f, struct child_result *cr) {
+  struct thread *t = thread_current();
+
+  struct fork_arguments *args = palloc_get_page(0);
+  if (args == NULL)
+    return TID_ERROR;
+  strlcpy(args->name, t->program_name, sizeof args->name);
+  args->parent = t;
+  args->if_ = *f;
+  sema_init(&args->ready, 0);
+  sema_init(&args->loaded, 0);
+
+  struct dir *cwd = t->working_directory ?
+                    dir_reopen(t->working_directory) : dir_open_root();
+
+  tid_t tid = thread_create_options(args->name, PRI_DEFAULT, start_fork,
+                                    args, cwd);
+  if (tid == TID_ERROR) {
+    dir_close(cwd);
+    palloc_free_page(args);
+    return TID_ERROR;
+  }
+
+  cr->pid = tid;
+  cr->exit_code = 999;
+  cr->has_load_failed = false;
+  list_push_back(&t->terminated_children, &cr->elem);
+  sema_up(&args->ready);
+
+  // ARGS is ours, so this works even if the child has exited since
+  sema_down(&args->loaded);
+  palloc_free_page(args);
+  return tid;
+}
+
+/* Gives T its own handles on the executable, open files and mapped
+   files of PARENT.  Files keep their positions, directories start
+   over. */
+static bool
+fork_files(struct thread *parent, struct thread *t) {
+  struct list_elem *e;
+
+  if (parent->exec_file != NULL) {
+    t->exec_file = file_reopen(parent->exec_file);
+    if (t->exec_file == NULL)
+      return false;
+    file_deny_write(t->exec_file);
+  }
+
+  for (e = list_begin(&parent->file_descriptors);
+       e != list_end(&parent->file_descriptors); e = list_next(e)) {
+    struct file_descriptor *p = list_entry(e, struct file_descriptor,
+                                           list_elem);
+    struct file_descriptor *fd = malloc(sizeof *fd);
+    if (fd == NULL)
+      return false;
+    *fd = *p;
+    if (p->is_directory)
+      fd->d = dir_reopen(p->d);
+    else {
+      fd->f = file_reopen(p->f);
+      if (fd->f != NULL)
+        file_seek(fd->f, file_tell(p->f));
+    }
+    // F and D share their storage, either being NULL means failure
+    if (fd->f == NULL) {
+      free(fd);
+      return false;
+    }
+    list_push_back(&t->file_descriptors, &fd->list_elem);
+  }
+
+  for (e = list_begin(&parent->mapped_files);
+       e != list_end(&parent->mapped_files); e = list_next(e)) {
+    struct m_file *p = list_entry(e, struct m_file, list_elem);
+    struct m_file *m_file = malloc(sizeof *m_file);
+    if (m_file == NULL)
+      return false;
+    *m_file = *p;
+    m_file->file = file_reopen(p->file);
+    if (m_file->file == NULL) {
+      free(m_file);
+      return false;
+    }
+    list_push_back(&t->mapped_files, &m_file->list_elem);
+  }
+  return true;
+}
+
+/* Writes PARENT's dirty mapped file pages back to their files, where
+   a forked child will read them from. */
+static void
+flush_mapped_files(struct thread *parent) {
+  struct list_elem *e;
+
+  for (e = list_begin(&parent->mapped_files);
+       e != list_end(&parent->mapped_files); e = list_next(e)) {
+    struct m_file *m_file = list_entry(e, struct m_file, list_elem);
+
+    fs_lock();
+    off_t length = file_length(m_file->file);
+    fs_unlock();
+    for (off_t ofs = 0; ofs < length; ofs += PGSIZE) {
+      void *upage = (void *) (m_file->vaddr + ofs);
+
+      frametable_lock();
+      struct spt_entry *se = spt_get_entry(parent, (uint32_t) upage,
+                                           parent->tid);
+      ASSERT(se != NULL);
+      if (se->spe_status != frame_from_file
+          || !pagedir_is_dirty(parent->pagedir, upage)) {
+        frametable_unlock();
+        continue;
+      }
+      void *kaddr = pagedir_get_page(parent->pagedir, upage);
+      pagedir_set_dirty(parent->pagedir, upage, false);
+      set_pinned(kaddr);
+      frametable_unlock();
+
+      // an older copy queued by eviction must be written first
+      writeback_wait(file_get_inode(m_file->file), (off_t) se->file_offset,
+                     (off_t) se->read_bytes);
+      fs_lock();
+      file_write_at(m_file->file, kaddr, (off_t) se->read_bytes,
+                    (off_t) se->file_offset);
+      fs_unlock();
+
+      frametable_lock();
+      unpin(kaddr);
+      frametable_unlock();
+    }
+  }
+}
+
+/* A thread function that turns a new thread into a copy of the
+   process that forked it.  The parent waits until this is done and
+   then frees ARGS_PTR. */
+static void
+start_fork(void *args_ptr) {
+  struct fork_arguments *args = args_ptr;
+  struct thread *t = thread_current();
+
+  sema_down(&args->ready);
+  struct thread *parent = args->parent;
+  struct intr_frame if_ = args->if_;
+
+  // the child sees fork() return 0
+  if_.eax = 0;
+
+  t->pagedir = pagedir_create();
+  bool success = t->pagedir != NULL;
+  if (success) {
+    process_activate();
+
+    fs_lock();
+    success = fork_files(parent, t);
+    fs_unlock();
+  }
+  if (success) {
+    flush_mapped_files(parent);
+    success = spt_fork(parent, t);
+  }
+
+  finish_load(success, &args->loaded);
 
-  /* Start the user process by simulating a return from an
-     interrupt, implemented by intr_exit (in
-     threads/intr-stubs.S).  Because intr_exit takes all of its
-     arguments on the stack in the form of a `struct intr_frame',
-     we just point the stack pointer (%esp) to our stack frame
-     and jump to it. */
   asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
   NOT_REACHED ();
 }
@@ -17,6 +17,7 @@
 #include <filesys/directory.h>
 #include <filesys/inode.h>
 #include "vm/frame.h"
+#include "vm/writeback.h"
 #include "pagedir.h"
 
 #define MIN(a, b)             \
@@ -76,6 +77,12 @@ static void handler_isdir(struct intr_frame *);
 
 static void handler_inumber(struct intr_frame *);
 
+static void handler_ftruncate(struct intr_frame *);
+
+static void handler_fallocate(struct intr_frame *);
+
+static void handler_fork(struct intr_frame *);
+
 void unsync_close_mfile(struct thread *t, struct m_file *m_file);
 
 void close_mfile(struct thread *t, struct m_file *m_file);
@@ -182,6 +189,18 @@ syscall_handler(struct intr_frame *f) {
       handler_inumber(f);
       break;
     }
+    case SYS_FTRUNCATE: {
+      handler_ftruncate(f);
+      break;
+    }
+    case SYS_FALLOCATE: {
+      handler_fallocate(f);
+      break;
+    }
+    case SYS_FORK: {
+      handler_fork(f);
+      break;
+    }
     default:
       printf("invalid system call!\n");
       process_terminate(thread_current(), -1, thread_current()->program_name);
@@ -913,6 +932,8 @@ void close_mfile(struct thread *t, struct m_file *m_file) {
   fs_lock();
   off_t fileLength = file_length(m_file->file);
   fs_unlock();
+  // copies queued by earlier evictions are older than what we write
+  writeback_wait(file_get_inode(m_file->file), 0, fileLength);
   frametable_lock();
   for (int i = 0; i < fileLength; i += PGSIZE) {
     struct spt_entry *entry_ptr = spt_get_entry(t,
@@ -929,6 +950,10 @@ void close_mfile(struct thread *t, struct m_file *m_file) {
         pagedir_set_dirty(t->pagedir, page_vaddr, false);
         set_pinned(kaddr);
         frametable_unlock();
+        // an older copy queued by eviction must be written first
+        writeback_wait(file_get_inode(m_file->file),
+                       (off_t) entry_copy.file_offset,
+                       (off_t) entry_copy.read_bytes);
         // page has been written to
         fs_lock();
         file_seek(m_file->file, (int) entry_copy.file_offset);
@@ -949,6 +974,9 @@ void close_mfile(struct thread *t, struct m_file *m_file) {
   }
   frametable_unlock();
 
+  // pages evicted earlier may still be queued for writing
+  writeback_wait(file_get_inode(m_file->file), 0, fileLength);
+
   fs_lock();
   file_close(m_file->file);
   fs_unlock();
@@ -1107,3 +1135,85 @@ static void handler_inumber(struct intr_frame *f)
   }
 }
 
+/*
+ * Sets the length of the file open as fd to length bytes, filling new bytes
+ * with zeros or discarding bytes past the new end. Space reserved with
+ * fallocate() past the new end is released.
+ */
+static void handler_ftruncate(struct intr_frame *f)
+{
+  int *stack = f->esp;
+
+  //args
+  int fd_id;
+  unsigned int length;
+  readu((const void *) (stack + 1), sizeof(fd_id), &fd_id);
+  readu((const void *) (stack + 2), sizeof(length), &length);
+
+  struct file_descriptor *fd = find_file_descriptor(fd_id, thread_current());
+
+  if (fd == NULL || fd->is_directory || length > INT32_MAX) {
+    f->eax = false;
+    return;
+  }
+
+  f->eax = file_truncate(fd->f, (off_t) length);
+}
+
+/*
+ * Reserves disk space for length bytes starting at offset in the file open
+ * as fd. The file's length does not change, no data is written.
+ */
+static void handler_fallocate(struct intr_frame *f)
+{
+  int *stack = f->esp;
+
+  //args
+  int fd_id;
+  unsigned int offset;
+  unsigned int length;
+  readu((const void *) (stack + 1), sizeof(fd_id), &fd_id);
+  readu((const void *) (stack + 2), sizeof(offset), &offset);
+  readu((const void *) (stack + 3), sizeof(length), &length);
+
+  struct file_descriptor *fd = find_file_descriptor(fd_id, thread_current());
+
+  if (fd == NULL || fd->is_directory
+      || offset > INT32_MAX || length > INT32_MAX) {
+    f->eax = false;
+    return;
+  }
+
+  f->eax = file_allocate(fd->f, (off_t) offset, (off_t) length);
+}
+
+static void handler_fork(struct intr_frame *f)
+{
+  // allocate child result early to avoid out-of-memory problems
+  struct child_result *cr = malloc(sizeof(struct child_result));
+  if (cr == NULL) {
+    syscall_ret_value(-1, f);
+    return;
+  }
+
+  tid_t pid = process_fork(f, cr);
+  if (pid == TID_ERROR) {
+    free(cr);
+    syscall_ret_value(-1, f);
+    return;
+  }
+
+  // the child has copied our state, but might be gone by now
+  enum intr_level il = intr_get_level();
+  intr_disable();
+  struct child_result *result = thread_terminated_child_from_tid(pid,
+          thread_current());
+  if (result != NULL && result->has_load_failed) {
+    list_remove(&result->elem);
+    free(result);
+    syscall_ret_value(-1, f);
+  } else {
+    syscall_ret_value(pid, f);
+  }
+  intr_set_level(il);
+}
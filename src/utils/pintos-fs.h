@@ -0,0 +1,79 @@
+#ifndef UTILS_PINTOS_FS_H
+#define UTILS_PINTOS_FS_H
+
+/* On-disk layout of the Pintos file system, as seen from the
+   host.  Everything here mirrors filesys/inode.c,
+   filesys/directory.c and filesys/free-map.c and must be kept in
+   sync with them.  The host tools assume a little-endian host,
+   like the i386 guest. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Size of a sector in bytes. */
+#define PFS_SECTOR_SIZE 512
+
+/* Sectors of system file inodes. */
+#define PFS_FREE_MAP_SECTOR 0   /* Free map file inode sector. */
+#define PFS_ROOT_DIR_SECTOR 1   /* Root directory file inode sector. */
+
+/* Identifies an inode. */
+#define PFS_INODE_MAGIC 0x494e4f44
+#define PFS_INODE_MAGIC_DIRECTORY 0x494e4f43
+
+/* Pointer layout of an inode. */
+#define PFS_DIRECT_CNT 124
+#define PFS_PTRS_PER_TABLE 128
+#define PFS_MAX_DATA_SECTORS (PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE \
+                              + PFS_PTRS_PER_TABLE * PFS_PTRS_PER_TABLE)
+
+/* Maximum length of a file name component. */
+#define PFS_NAME_MAX 14
+
+/* Number of entries a newly created directory has room for. */
+#define PFS_DIR_INITIAL_ENTRIES 16
+
+/* Name of the entry that refers to a directory's parent. */
+#define PFS_PARENT_NAME ".."
+
+/* On-disk inode.  A sector number of 0 marks an unused pointer,
+   since sector 0 always holds the free map inode. */
+struct pfs_inode_disk
+  {
+    int32_t length;                     /* File size in bytes. */
+    uint32_t magic;                     /* Magic number. */
+    uint32_t direct[PFS_DIRECT_CNT];    /* Data sectors. */
+    uint32_t indirect;                  /* Table of data sectors. */
+    uint32_t doubleindirect;            /* Table of tables. */
+  };
+
+/* Indirect or double-indirect pointer table. */
+struct pfs_pointer_table
+  {
+    uint32_t pointers[PFS_PTRS_PER_TABLE];
+  };
+
+/* A single directory entry. */
+struct pfs_dir_entry
+  {
+    uint32_t inode_sector;              /* Sector number of header. */
+    char name[PFS_NAME_MAX + 1];        /* Null terminated file name. */
+    bool in_use;                        /* In use or free? */
+  };
+
+/* Returns the number of bytes the free map file occupies for a
+   device of SECTOR_CNT sectors, matching bitmap_file_size(). */
+static inline uint32_t
+pfs_free_map_bytes (uint32_t sector_cnt)
+{
+  return (sector_cnt + 31) / 32 * 4;
+}
+
+/* Returns the number of sectors needed to hold SIZE bytes. */
+static inline uint32_t
+pfs_bytes_to_sectors (uint32_t size)
+{
+  return (size + PFS_SECTOR_SIZE - 1) / PFS_SECTOR_SIZE;
+}
+
+#endif /* utils/pintos-fs.h */
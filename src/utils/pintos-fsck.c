@@ -0,0 +1,604 @@
+/* pintos-fsck: checks a Pintos file system image on the host.
+
+   Walks the directory tree from the root, claims every sector
+   reachable from an inode (the inode itself, its data sectors
+   and its pointer tables) and cross-checks the result against
+   the on-disk free map.  Reports leaked sectors, sectors claimed
+   twice, sectors in use but marked free, and layout statistics:
+   extents per file and a histogram of free-space runs. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pintos-fs.h"
+
+/* Partition type of a Pintos file system, see Pintos.pm. */
+#define PARTITION_TYPE_FILESYS 0x21
+
+/* Owner value for sectors that no inode claims. */
+#define NO_OWNER UINT32_MAX
+
+/* Number of buckets in the free-run histogram, by power of two. */
+#define RUN_BUCKETS 24
+
+static const char *program_name;
+static bool verbose;
+
+static uint8_t *image;                  /* File system contents. */
+static uint32_t sector_cnt;             /* File system size in sectors. */
+static uint32_t *owner;                 /* Inode claiming each sector. */
+static const uint8_t *free_map;         /* On-disk free map. */
+
+static unsigned long error_cnt;         /* Problems found. */
+
+/* Layout statistics. */
+static unsigned long file_cnt, dir_cnt;
+static unsigned long fragmented_cnt;    /* Files with >1 extent. */
+static unsigned long total_extents;     /* Sum over non-empty files. */
+static unsigned long max_extents;
+static unsigned long data_file_cnt;     /* Files with any data. */
+static unsigned long reserved_cnt;      /* Sectors reserved past EOF. */
+
+static void
+fail (const char *msg, ...)
+     __attribute__ ((noreturn))
+     __attribute__ ((format (printf, 1, 2)));
+
+/* Prints MSG, formatting as with printf(), and exits. */
+static void
+fail (const char *msg, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s: ", program_name);
+  va_start (args, msg);
+  vfprintf (stderr, msg, args);
+  va_end (args);
+  putc ('\n', stderr);
+  exit (2);
+}
+
+static void
+problem (const char *msg, ...)
+     __attribute__ ((format (printf, 1, 2)));
+
+/* Reports an inconsistency in the file system. */
+static void
+problem (const char *msg, ...)
+{
+  va_list args;
+
+  va_start (args, msg);
+  vprintf (msg, args);
+  va_end (args);
+  putchar ('\n');
+  error_cnt++;
+}
+
+/* Returns the contents of SECTOR, or a null pointer if SECTOR is
+   outside the file system. */
+static const void *
+sector_data (uint32_t sector)
+{
+  if (sector >= sector_cnt)
+    return NULL;
+  return image + (size_t) sector * PFS_SECTOR_SIZE;
+}
+
+/* Records that inode INUMBER, named PATH, uses SECTOR for WHAT.
+   Returns false if the sector could not be claimed. */
+static bool
+claim (uint32_t sector, uint32_t inumber, const char *path,
+       const char *what)
+{
+  if (sector >= sector_cnt)
+    {
+      problem ("%s: %s sector %"PRIu32" is past the end of the device",
+               path, what, sector);
+      return false;
+    }
+  if (owner[sector] != NO_OWNER)
+    {
+      problem ("%s: %s sector %"PRIu32" is also used by inode %"PRIu32,
+               path, what, sector, owner[sector]);
+      return false;
+    }
+  owner[sector] = inumber;
+  return true;
+}
+
+/* Returns whether the free map marks SECTOR as allocated. */
+static bool
+free_map_test (uint32_t sector)
+{
+  return (free_map[sector / 8] >> (sector % 8)) & 1;
+}
+
+/* An inode as loaded by walk_inode(). */
+struct inode_info
+  {
+    const struct pfs_inode_disk *disk;
+    uint32_t *sectors;                  /* Data sectors, in file order. */
+    uint32_t sector_cnt;                /* Number of data sectors. */
+  };
+
+/* Claims pointer table SECTOR and returns its contents, or a null
+   pointer if it is unusable. */
+static const struct pfs_pointer_table *
+claim_table (uint32_t sector, uint32_t inumber, const char *path,
+             const char *what)
+{
+  if (sector == 0)
+    {
+      problem ("%s: missing %s table", path, what);
+      return NULL;
+    }
+  if (!claim (sector, inumber, path, what))
+    return NULL;
+  return sector_data (sector);
+}
+
+/* Checks the unused tail of pointer array P, from FIRST to CNT,
+   for stray nonzero pointers. */
+static void
+check_unused (const uint32_t *p, uint32_t first, uint32_t cnt,
+              const char *path)
+{
+  uint32_t i;
+
+  for (i = first; i < cnt; i++)
+    if (p[i] != 0)
+      {
+        problem ("%s: stray pointer to sector %"PRIu32,
+                 path, p[i]);
+        return;
+      }
+}
+
+/* Returns data pointer IDX of DISK without claiming anything, or
+   0 if it or a table leading to it is missing. */
+static uint32_t
+peek_pointer (const struct pfs_inode_disk *disk, uint32_t idx)
+{
+  const uint32_t base = PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE;
+  const struct pfs_pointer_table *table;
+
+  if (idx < PFS_DIRECT_CNT)
+    return disk->direct[idx];
+  if (idx < base)
+    {
+      table = disk->indirect != 0 ? sector_data (disk->indirect) : NULL;
+      return table != NULL ? table->pointers[idx - PFS_DIRECT_CNT] : 0;
+    }
+  table = disk->doubleindirect != 0 ? sector_data (disk->doubleindirect) : NULL;
+  if (table == NULL)
+    return 0;
+  idx -= base;
+  if (table->pointers[idx / PFS_PTRS_PER_TABLE] == 0)
+    return 0;
+  table = sector_data (table->pointers[idx / PFS_PTRS_PER_TABLE]);
+  return table != NULL ? table->pointers[idx % PFS_PTRS_PER_TABLE] : 0;
+}
+
+/* Loads inode INUMBER, named PATH, claiming its inode sector, data
+   sectors and pointer tables.  Sectors reserved past the end of
+   file, e.g. by fallocate(), continue the run of data pointers
+   and are claimed as well.  Returns false if the inode is
+   unusable. */
+static bool
+walk_inode (uint32_t inumber, const char *path, struct inode_info *info)
+{
+  const struct pfs_inode_disk *disk = sector_data (inumber);
+  const uint32_t base = PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE;
+  const struct pfs_pointer_table *indirect = NULL, *tables = NULL;
+  const struct pfs_pointer_table *table = NULL;
+  uint32_t length_cnt, cnt, i;
+
+  memset (info, 0, sizeof *info);
+  if (!claim (inumber, inumber, path, "inode"))
+    return false;
+  if (disk->magic != PFS_INODE_MAGIC
+      && disk->magic != PFS_INODE_MAGIC_DIRECTORY)
+    {
+      problem ("%s: inode %"PRIu32" has bad magic %#"PRIx32,
+               path, inumber, disk->magic);
+      return false;
+    }
+  if (disk->length < 0
+      || pfs_bytes_to_sectors (disk->length) > PFS_MAX_DATA_SECTORS)
+    {
+      problem ("%s: inode %"PRIu32" has bad length %"PRId32,
+               path, inumber, disk->length);
+      return false;
+    }
+
+  length_cnt = pfs_bytes_to_sectors (disk->length);
+  for (cnt = length_cnt; cnt < PFS_MAX_DATA_SECTORS; cnt++)
+    if (peek_pointer (disk, cnt) == 0)
+      break;
+  info->disk = disk;
+  info->sectors = calloc (length_cnt + 1, sizeof *info->sectors);
+  if (info->sectors == NULL)
+    fail ("out of memory");
+
+  check_unused (disk->direct, cnt < PFS_DIRECT_CNT ? cnt : PFS_DIRECT_CNT,
+                PFS_DIRECT_CNT, path);
+  if (cnt > PFS_DIRECT_CNT)
+    indirect = claim_table (disk->indirect, inumber, path, "indirect");
+  else if (disk->indirect != 0)
+    problem ("%s: unneeded indirect table %"PRIu32, path, disk->indirect);
+  if (cnt > base)
+    tables = claim_table (disk->doubleindirect, inumber, path,
+                          "double indirect");
+  else if (disk->doubleindirect != 0)
+    problem ("%s: unneeded double indirect table %"PRIu32,
+             path, disk->doubleindirect);
+
+  if (indirect != NULL)
+    check_unused (indirect->pointers,
+                  cnt - PFS_DIRECT_CNT < PFS_PTRS_PER_TABLE
+                  ? cnt - PFS_DIRECT_CNT : PFS_PTRS_PER_TABLE,
+                  PFS_PTRS_PER_TABLE, path);
+  if (tables != NULL)
+    check_unused (tables->pointers,
+                  (cnt - base + PFS_PTRS_PER_TABLE - 1) / PFS_PTRS_PER_TABLE,
+                  PFS_PTRS_PER_TABLE, path);
+
+  for (i = 0; i < cnt; i++)
+    {
+      uint32_t sector = 0;
+
+      if (i < PFS_DIRECT_CNT)
+        sector = disk->direct[i];
+      else if (i < base)
+        {
+          if (indirect == NULL)
+            break;
+          sector = indirect->pointers[i - PFS_DIRECT_CNT];
+        }
+      else
+        {
+          uint32_t table_idx = (i - base) / PFS_PTRS_PER_TABLE;
+          uint32_t table_ofs = (i - base) % PFS_PTRS_PER_TABLE;
+
+          if (tables == NULL)
+            break;
+          if (table_ofs == 0)
+            table = claim_table (tables->pointers[table_idx], inumber,
+                                 path, "second level");
+          if (table == NULL)
+            continue;
+          if (table_ofs == 0 && cnt - i < PFS_PTRS_PER_TABLE)
+            check_unused (table->pointers, cnt - i, PFS_PTRS_PER_TABLE,
+                          path);
+          sector = table->pointers[table_ofs];
+        }
+
+      if (sector == 0)
+        problem ("%s: data sector %"PRIu32" of %"PRIu32" is missing",
+                 path, i, cnt);
+      else if (i >= length_cnt)
+        {
+          if (claim (sector, inumber, path, "reserved"))
+            reserved_cnt++;
+        }
+      else if (claim (sector, inumber, path, "data"))
+        info->sectors[info->sector_cnt++] = sector;
+    }
+  return true;
+}
+
+/* Returns the number of runs of consecutive sectors in INFO's
+   data, in file order. */
+static uint32_t
+count_extents (const struct inode_info *info)
+{
+  uint32_t extents = 0;
+  uint32_t i;
+
+  for (i = 0; i < info->sector_cnt; i++)
+    if (i == 0 || info->sectors[i] != info->sectors[i - 1] + 1)
+      extents++;
+  return extents;
+}
+
+/* Records layout statistics for regular file INFO named PATH. */
+static void
+account_file (const struct inode_info *info, const char *path)
+{
+  uint32_t extents = count_extents (info);
+
+  file_cnt++;
+  if (extents > 0)
+    {
+      data_file_cnt++;
+      total_extents += extents;
+      if (extents > max_extents)
+        max_extents = extents;
+      if (extents > 1)
+        fragmented_cnt++;
+    }
+  if (verbose)
+    printf ("%s: %"PRId32" bytes, %"PRIu32" sectors, %"PRIu32" extents\n",
+            path, info->disk->length, info->sector_cnt, extents);
+}
+
+/* Reads the whole data of INFO into a newly allocated buffer. */
+static uint8_t *
+read_data (const struct inode_info *info)
+{
+  uint8_t *data = calloc (info->sector_cnt + 1, PFS_SECTOR_SIZE);
+  uint32_t i;
+
+  if (data == NULL)
+    fail ("out of memory");
+  for (i = 0; i < info->sector_cnt; i++)
+    memcpy (data + (size_t) i * PFS_SECTOR_SIZE,
+            sector_data (info->sectors[i]), PFS_SECTOR_SIZE);
+  return data;
+}
+
+/* Walks directory INUMBER, named PATH, whose parent is
+   PARENT_INUMBER, and everything below it. */
+static void
+walk_dir (uint32_t inumber, uint32_t parent_inumber, const char *path)
+{
+  struct inode_info info;
+  const struct pfs_dir_entry *entries;
+  uint8_t *data;
+  size_t entry_cnt, i;
+  bool have_parent = false;
+
+  if (!walk_inode (inumber, path, &info))
+    return;
+  if (info.disk->magic != PFS_INODE_MAGIC_DIRECTORY)
+    {
+      problem ("%s: not a directory", path);
+      free (info.sectors);
+      return;
+    }
+  dir_cnt++;
+  if (verbose)
+    printf ("%s/: %"PRId32" bytes, %"PRIu32" extents\n",
+            path, info.disk->length, count_extents (&info));
+
+  data = read_data (&info);
+  entries = (const struct pfs_dir_entry *) data;
+  entry_cnt = info.disk->length / sizeof *entries;
+  for (i = 0; i < entry_cnt; i++)
+    {
+      const struct pfs_dir_entry *e = &entries[i];
+      char *child;
+
+      if (!e->in_use)
+        continue;
+      if (memchr (e->name, '\0', sizeof e->name) == NULL)
+        {
+          problem ("%s: entry %zu has an unterminated name", path, i);
+          continue;
+        }
+      if (!strcmp (e->name, PFS_PARENT_NAME))
+        {
+          if (e->inode_sector != parent_inumber)
+            problem ("%s: \"..\" points to %"PRIu32", expected %"PRIu32,
+                     path, e->inode_sector, parent_inumber);
+          have_parent = true;
+          continue;
+        }
+
+      child = malloc (strlen (path) + strlen (e->name) + 2);
+      if (child == NULL)
+        fail ("out of memory");
+      sprintf (child, "%s/%s", path, e->name);
+
+      if (e->inode_sector >= sector_cnt)
+        problem ("%s: inode sector %"PRIu32" past end of device",
+                 child, e->inode_sector);
+      else if (owner[e->inode_sector] != NO_OWNER)
+        problem ("%s: inode %"PRIu32" is already in use "
+                 "(linked twice or overlapping)", child, e->inode_sector);
+      else if (((const struct pfs_inode_disk *)
+                sector_data (e->inode_sector))->magic
+               == PFS_INODE_MAGIC_DIRECTORY)
+        walk_dir (e->inode_sector, inumber, child);
+      else
+        {
+          struct inode_info file;
+          if (walk_inode (e->inode_sector, child, &file))
+            account_file (&file, child);
+          free (file.sectors);
+        }
+      free (child);
+    }
+  if (!have_parent)
+    problem ("%s: missing \"..\" entry", path);
+
+  free (data);
+  free (info.sectors);
+}
+
+/* Loads the image in FILE_NAME.  If it is a partitioned disk,
+   only its file system partition is kept. */
+static void
+load_image (const char *file_name)
+{
+  FILE *f = fopen (file_name, "rb");
+  long size;
+  uint32_t start = 0;
+
+  if (f == NULL)
+    fail ("%s: open: %s", file_name, strerror (errno));
+  if (fseek (f, 0, SEEK_END) != 0 || (size = ftell (f)) < 0)
+    fail ("%s: seek failed", file_name);
+  rewind (f);
+  sector_cnt = size / PFS_SECTOR_SIZE;
+  if (sector_cnt < 2)
+    fail ("%s: too small to hold a file system", file_name);
+  image = malloc ((size_t) sector_cnt * PFS_SECTOR_SIZE);
+  if (image == NULL)
+    fail ("out of memory");
+  if (fread (image, PFS_SECTOR_SIZE, sector_cnt, f) != sector_cnt)
+    fail ("%s: read failed", file_name);
+  fclose (f);
+
+  /* A Pintos disk with a partition table, as made by
+     pintos-mkdisk, has the MBR signature and a file system
+     partition entry.  A bare file system image cannot have the
+     signature, because the end of sector 0 is the free map
+     inode's doubleindirect pointer, which is always zero. */
+  if (image[510] == 0x55 && image[511] == 0xaa)
+    {
+      int i;
+
+      for (i = 0; i < 4; i++)
+        {
+          const uint8_t *entry = image + 446 + 16 * i;
+          uint32_t ofs, cnt;
+
+          memcpy (&ofs, entry + 8, sizeof ofs);
+          memcpy (&cnt, entry + 12, sizeof cnt);
+          if (entry[4] == PARTITION_TYPE_FILESYS)
+            {
+              if (ofs >= sector_cnt || cnt > sector_cnt - ofs)
+                fail ("%s: file system partition exceeds disk", file_name);
+              start = ofs;
+              sector_cnt = cnt;
+              break;
+            }
+        }
+      if (i == 4)
+        fail ("%s: partitioned disk without a file system partition",
+              file_name);
+      memmove (image, image + (size_t) start * PFS_SECTOR_SIZE,
+               (size_t) sector_cnt * PFS_SECTOR_SIZE);
+    }
+  if (verbose)
+    printf ("file system at sector %"PRIu32", %"PRIu32" sectors\n",
+            start, sector_cnt);
+}
+
+/* Cross-checks claimed sectors against the free map and prints
+   the free-space run histogram. */
+static void
+check_free_map (void)
+{
+  unsigned long runs[RUN_BUCKETS];
+  unsigned long leaked = 0, unmarked = 0, free_cnt = 0, run_cnt = 0;
+  uint32_t run = 0, largest = 0;
+  uint32_t sector;
+  int i;
+
+  memset (runs, 0, sizeof runs);
+  for (sector = 0; sector <= sector_cnt; sector++)
+    {
+      bool allocated = sector < sector_cnt && free_map_test (sector);
+
+      if (sector < sector_cnt && allocated && owner[sector] == NO_OWNER)
+        {
+          if (verbose)
+            printf ("sector %"PRIu32" leaked\n", sector);
+          leaked++;
+        }
+      else if (sector < sector_cnt && !allocated
+               && owner[sector] != NO_OWNER)
+        {
+          problem ("sector %"PRIu32" used by inode %"PRIu32
+                   " but marked free", sector, owner[sector]);
+          unmarked++;
+        }
+
+      if (sector < sector_cnt && !allocated)
+        {
+          free_cnt++;
+          run++;
+        }
+      else if (run > 0)
+        {
+          int bucket = 0;
+          while (bucket + 1 < RUN_BUCKETS && (2u << bucket) <= run)
+            bucket++;
+          runs[bucket]++;
+          run_cnt++;
+          if (run > largest)
+            largest = run;
+          run = 0;
+        }
+    }
+  if (leaked > 0)
+    problem ("%lu sectors marked allocated but unreachable (leaked)",
+             leaked);
+
+  printf ("free space: %lu of %"PRIu32" sectors in %lu runs, "
+          "largest %"PRIu32"\n", free_cnt, sector_cnt, run_cnt, largest);
+  for (i = 0; i < RUN_BUCKETS; i++)
+    if (runs[i] != 0)
+      printf ("  runs of %8lu-%-8lu sectors: %lu\n",
+              1ul << i, (2ul << i) - 1, runs[i]);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct inode_info free_map_info;
+  uint8_t *free_map_data;
+  uint32_t i;
+  int argi;
+
+  program_name = argv[0];
+  for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++)
+    if (!strcmp (argv[argi], "-v") || !strcmp (argv[argi], "--verbose"))
+      verbose = true;
+    else
+      break;
+  if (argi + 1 != argc)
+    {
+      fprintf (stderr,
+               "pintos-fsck: checks a Pintos file system image\n"
+               "usage: %s [-v] IMAGE\n"
+               "  where IMAGE is a bare file system image, as made by\n"
+               "  pintos-mkfs, or a partitioned disk, as made by\n"
+               "  pintos-mkdisk.  -v lists every file and leaked sector.\n"
+               "Exit status is 0 if the file system is consistent,\n"
+               "1 if problems were found, 2 on usage or I/O errors.\n",
+               program_name);
+      return 2;
+    }
+
+  load_image (argv[argi]);
+  owner = malloc ((size_t) sector_cnt * sizeof *owner);
+  if (owner == NULL)
+    fail ("out of memory");
+  for (i = 0; i < sector_cnt; i++)
+    owner[i] = NO_OWNER;
+
+  /* The free map is an ordinary file in sector 0. */
+  if (!walk_inode (PFS_FREE_MAP_SECTOR, "[free map]", &free_map_info))
+    fail ("free map inode is unusable");
+  if ((uint32_t) free_map_info.disk->length < pfs_free_map_bytes (sector_cnt))
+    fail ("free map holds %"PRId32" bytes, need %"PRIu32,
+          free_map_info.disk->length, pfs_free_map_bytes (sector_cnt));
+  free_map_data = read_data (&free_map_info);
+  free_map = free_map_data;
+
+  walk_dir (PFS_ROOT_DIR_SECTOR, PFS_ROOT_DIR_SECTOR, "");
+  check_free_map ();
+
+  printf ("%lu files, %lu directories\n", file_cnt, dir_cnt);
+  if (reserved_cnt > 0)
+    printf ("%lu sectors reserved past end of file\n", reserved_cnt);
+  if (data_file_cnt > 0)
+    printf ("extents per non-empty file: %.2f average, %lu maximum, "
+            "%lu of %lu files fragmented\n",
+            (double) total_extents / data_file_cnt, max_extents,
+            fragmented_cnt, data_file_cnt);
+  printf ("%lu problems found\n", error_cnt);
+
+  free (free_map_data);
+  free (free_map_info.sectors);
+  return error_cnt == 0 ? 0 : 1;
+}
@@ -0,0 +1,525 @@
+/* pintos-mkfs: creates a formatted Pintos file system image on
+   the host, optionally populated with files and directories.
+
+   The image is a bare file system partition, laid out exactly as
+   filesys/inode.c, filesys/directory.c and filesys/free-map.c
+   expect, so it can be wrapped into a virtual disk with
+   "pintos-mkdisk --filesys=IMAGE" and used without booting the
+   kernel with -f or extracting a scratch archive. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "pintos-fs.h"
+
+/* A file or directory inside a directory being built. */
+struct entry
+  {
+    char name[PFS_NAME_MAX + 1];        /* File name. */
+    uint32_t inode_sector;              /* Sector of the inode. */
+    struct dir_node *dir;               /* Non-null for directories. */
+  };
+
+/* A directory being built.  Its contents are only written once
+   every entry is known, see write_dirs(). */
+struct dir_node
+  {
+    uint32_t inode_sector;              /* Sector of the inode. */
+    struct entry *entries;              /* Entries, including "..". */
+    size_t entry_cnt;                   /* Number of entries. */
+    size_t entry_cap;                   /* Allocated entries. */
+    struct dir_node *next;              /* Next in all_dirs. */
+  };
+
+static const char *program_name;
+static bool verbose;
+
+static uint8_t *image;                  /* Image contents. */
+static uint32_t sector_cnt;             /* Image size in sectors. */
+static uint8_t *used_map;               /* One bit per sector. */
+static uint32_t next_free;              /* Allocation cursor. */
+
+static struct dir_node *all_dirs;       /* Every directory. */
+static struct dir_node *root_dir;       /* Root directory. */
+static size_t file_cnt;                 /* Number of regular files. */
+
+static void
+fail (const char *msg, ...)
+     __attribute__ ((noreturn))
+     __attribute__ ((format (printf, 1, 2)));
+
+/* Prints MSG, formatting as with printf(), and exits. */
+static void
+fail (const char *msg, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s: ", program_name);
+  va_start (args, msg);
+  vfprintf (stderr, msg, args);
+  va_end (args);
+  putc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Allocates SIZE bytes or exits. */
+static void *
+xcalloc (size_t cnt, size_t size)
+{
+  void *p = calloc (cnt, size);
+  if (p == NULL)
+    fail ("out of memory");
+  return p;
+}
+
+/* Returns the contents of SECTOR within the image. */
+static void *
+sector_data (uint32_t sector)
+{
+  return image + (size_t) sector * PFS_SECTOR_SIZE;
+}
+
+/* Marks SECTOR as in use in the free map. */
+static void
+mark_used (uint32_t sector)
+{
+  used_map[sector / 8] |= 1u << (sector % 8);
+}
+
+/* Allocates CNT consecutive sectors and returns the first.
+   Nothing is ever freed while building an image, so sectors are
+   handed out in order and every file ends up contiguous. */
+static uint32_t
+allocate (uint32_t cnt)
+{
+  uint32_t first = next_free;
+  uint32_t i;
+
+  if (cnt > sector_cnt - next_free)
+    fail ("image full: need %"PRIu32" more sectors, "
+          "only %"PRIu32" left (use a larger --size)",
+          cnt, sector_cnt - next_free);
+  for (i = 0; i < cnt; i++)
+    mark_used (first + i);
+  next_free += cnt;
+  return first;
+}
+
+/* Writes an inode with the given MAGIC and LENGTH bytes of DATA
+   (or zeros, if DATA is null) to INODE_SECTOR.  Data sectors are
+   allocated as a single run, followed by whatever pointer tables
+   the length requires.  Returns the first data sector. */
+static uint32_t
+write_inode (uint32_t inode_sector, uint32_t magic,
+             const void *data, uint32_t length)
+{
+  struct pfs_inode_disk *disk_inode = sector_data (inode_sector);
+  uint32_t data_cnt = pfs_bytes_to_sectors (length);
+  uint32_t first = 0;
+  uint32_t i;
+
+  if (data_cnt > PFS_MAX_DATA_SECTORS)
+    fail ("file of %"PRIu32" bytes exceeds the maximum file size", length);
+
+  memset (disk_inode, 0, sizeof *disk_inode);
+  disk_inode->length = length;
+  disk_inode->magic = magic;
+  if (data_cnt == 0)
+    return 0;
+
+  first = allocate (data_cnt);
+  if (data != NULL)
+    memcpy (sector_data (first), data, length);
+
+  for (i = 0; i < data_cnt && i < PFS_DIRECT_CNT; i++)
+    disk_inode->direct[i] = first + i;
+
+  if (data_cnt > PFS_DIRECT_CNT)
+    {
+      struct pfs_pointer_table *indirect;
+
+      disk_inode->indirect = allocate (1);
+      indirect = sector_data (disk_inode->indirect);
+      for (i = PFS_DIRECT_CNT;
+           i < data_cnt && i < PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE; i++)
+        indirect->pointers[i - PFS_DIRECT_CNT] = first + i;
+    }
+
+  if (data_cnt > PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE)
+    {
+      uint32_t base = PFS_DIRECT_CNT + PFS_PTRS_PER_TABLE;
+      struct pfs_pointer_table *tables;
+
+      disk_inode->doubleindirect = allocate (1);
+      tables = sector_data (disk_inode->doubleindirect);
+      for (i = base; i < data_cnt; i++)
+        {
+          uint32_t table_idx = (i - base) / PFS_PTRS_PER_TABLE;
+          struct pfs_pointer_table *table;
+
+          if (tables->pointers[table_idx] == 0)
+            tables->pointers[table_idx] = allocate (1);
+          table = sector_data (tables->pointers[table_idx]);
+          table->pointers[(i - base) % PFS_PTRS_PER_TABLE] = first + i;
+        }
+    }
+
+  return first;
+}
+
+/* Appends an entry named NAME for INODE_SECTOR to DIR and returns
+   it.  DIR_NODE is non-null if the entry is a directory. */
+static struct entry *
+dir_add (struct dir_node *dir, const char *name, uint32_t inode_sector,
+         struct dir_node *dir_node)
+{
+  struct entry *e;
+
+  if (dir->entry_cnt == dir->entry_cap)
+    {
+      dir->entry_cap = dir->entry_cap * 2 + PFS_DIR_INITIAL_ENTRIES;
+      dir->entries = realloc (dir->entries,
+                              dir->entry_cap * sizeof *dir->entries);
+      if (dir->entries == NULL)
+        fail ("out of memory");
+    }
+  e = &dir->entries[dir->entry_cnt++];
+  memset (e, 0, sizeof *e);
+  strcpy (e->name, name);
+  e->inode_sector = inode_sector;
+  e->dir = dir_node;
+  return e;
+}
+
+/* Returns the entry named NAME in DIR, or a null pointer. */
+static struct entry *
+dir_lookup (struct dir_node *dir, const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < dir->entry_cnt; i++)
+    if (!strcmp (dir->entries[i].name, name))
+      return &dir->entries[i];
+  return NULL;
+}
+
+/* Creates a new, empty directory whose parent is PARENT_SECTOR
+   and returns it.  Its inode sector is allocated right away; its
+   contents are written by write_dirs(). */
+static struct dir_node *
+dir_new (uint32_t inode_sector, uint32_t parent_sector)
+{
+  struct dir_node *dir = xcalloc (1, sizeof *dir);
+
+  dir->inode_sector = inode_sector;
+  dir_add (dir, PFS_PARENT_NAME, parent_sector, NULL);
+  dir->next = all_dirs;
+  all_dirs = dir;
+  return dir;
+}
+
+/* Checks that NAME is a valid file name component. */
+static void
+check_name (const char *name)
+{
+  if (*name == '\0' || !strcmp (name, ".") || !strcmp (name, ".."))
+    fail ("\"%s\": invalid file name", name);
+  if (strlen (name) > PFS_NAME_MAX)
+    fail ("\"%s\": file name longer than %d characters",
+          name, PFS_NAME_MAX);
+}
+
+/* Returns the directory named NAME in PARENT, creating it if
+   necessary. */
+static struct dir_node *
+get_dir (struct dir_node *parent, const char *name)
+{
+  struct entry *e = dir_lookup (parent, name);
+  uint32_t sector;
+  struct dir_node *dir;
+
+  if (e != NULL)
+    {
+      if (e->dir == NULL)
+        fail ("\"%s\": exists and is not a directory", name);
+      return e->dir;
+    }
+
+  check_name (name);
+  sector = allocate (1);
+  dir = dir_new (sector, parent->inode_sector);
+  dir_add (parent, name, sector, dir);
+  return dir;
+}
+
+/* Splits GUEST into directory components, creating each
+   directory that does not exist yet.  Stores the final component
+   in *BASE and returns the directory that should contain it. */
+static struct dir_node *
+resolve_parent (char *guest, char **base)
+{
+  struct dir_node *dir = root_dir;
+  char *slash;
+
+  while (*guest == '/')
+    guest++;
+  while ((slash = strchr (guest, '/')) != NULL)
+    {
+      *slash = '\0';
+      if (*guest != '\0')
+        dir = get_dir (dir, guest);
+      guest = slash + 1;
+    }
+  *base = guest;
+  return dir;
+}
+
+/* Reads host file HOST and adds it to DIR as NAME. */
+static void
+add_file (struct dir_node *dir, const char *name, const char *host,
+          off_t size)
+{
+  uint32_t sector;
+  void *data = NULL;
+
+  check_name (name);
+  if (dir_lookup (dir, name) != NULL)
+    fail ("\"%s\": duplicate file name", name);
+  if (size > INT32_MAX)
+    fail ("%s: file too large", host);
+
+  if (size > 0)
+    {
+      FILE *f = fopen (host, "rb");
+      if (f == NULL)
+        fail ("%s: open: %s", host, strerror (errno));
+      data = xcalloc (1, size);
+      if (fread (data, 1, size, f) != (size_t) size)
+        fail ("%s: read failed", host);
+      fclose (f);
+    }
+
+  sector = allocate (1);
+  write_inode (sector, PFS_INODE_MAGIC, data, size);
+  dir_add (dir, name, sector, NULL);
+  free (data);
+  file_cnt++;
+
+  if (verbose)
+    printf ("%s: %jd bytes\n", host, (intmax_t) size);
+}
+
+static void add_tree (struct dir_node *, const char *name, const char *host);
+
+/* Adds every entry in host directory HOST to DIR, in sorted
+   order so that images are reproducible. */
+static void
+add_dir_contents (struct dir_node *dir, const char *host)
+{
+  struct dirent **names;
+  int cnt, i;
+
+  cnt = scandir (host, &names, NULL, alphasort);
+  if (cnt < 0)
+    fail ("%s: scandir: %s", host, strerror (errno));
+  for (i = 0; i < cnt; i++)
+    {
+      const char *name = names[i]->d_name;
+      if (strcmp (name, ".") && strcmp (name, ".."))
+        {
+          char *path = xcalloc (1, strlen (host) + strlen (name) + 2);
+          sprintf (path, "%s/%s", host, name);
+          add_tree (dir, name, path);
+          free (path);
+        }
+      free (names[i]);
+    }
+  free (names);
+}
+
+/* Adds host file or directory HOST to DIR as NAME. */
+static void
+add_tree (struct dir_node *dir, const char *name, const char *host)
+{
+  struct stat st;
+
+  if (stat (host, &st) < 0)
+    fail ("%s: stat: %s", host, strerror (errno));
+  if (S_ISDIR (st.st_mode))
+    add_dir_contents (*name != '\0' ? get_dir (dir, name) : dir, host);
+  else if (S_ISREG (st.st_mode))
+    add_file (dir, name, host, st.st_size);
+  else
+    fail ("%s: not a regular file or directory", host);
+}
+
+/* Adds the file or directory named by ARG, which has the form
+   HOST or HOST=GUEST.  By default the guest name is the last
+   component of HOST, in the root directory. */
+static void
+add_arg (const char *arg)
+{
+  char *host = strdup (arg);
+  char *guest = strchr (host, '=');
+  struct dir_node *dir;
+  char *base;
+
+  if (host == NULL)
+    fail ("out of memory");
+  if (guest != NULL)
+    *guest++ = '\0';
+  else
+    {
+      size_t len = strlen (host);
+      while (len > 1 && host[len - 1] == '/')
+        host[--len] = '\0';
+      guest = strrchr (host, '/') != NULL ? strrchr (host, '/') + 1 : host;
+      guest = strdup (guest);
+      if (guest == NULL)
+        fail ("out of memory");
+    }
+
+  dir = resolve_parent (guest, &base);
+  add_tree (dir, base, host);
+  free (host);
+}
+
+/* Writes every directory's entries.  A directory holds at least
+   PFS_DIR_INITIAL_ENTRIES entries, as dir_create() would give
+   it, and unused slots are left zeroed (not in use). */
+static void
+write_dirs (void)
+{
+  struct dir_node *dir;
+
+  for (dir = all_dirs; dir != NULL; dir = dir->next)
+    {
+      size_t slot_cnt = dir->entry_cnt > PFS_DIR_INITIAL_ENTRIES
+                        ? dir->entry_cnt : PFS_DIR_INITIAL_ENTRIES;
+      struct pfs_dir_entry *slots = xcalloc (slot_cnt, sizeof *slots);
+      size_t i;
+
+      for (i = 0; i < dir->entry_cnt; i++)
+        {
+          slots[i].inode_sector = dir->entries[i].inode_sector;
+          strcpy (slots[i].name, dir->entries[i].name);
+          slots[i].in_use = true;
+        }
+      write_inode (dir->inode_sector, PFS_INODE_MAGIC_DIRECTORY,
+                   slots, slot_cnt * sizeof *slots);
+      free (slots);
+    }
+}
+
+/* Parses a size in megabytes, as pintos-mkdisk does. */
+static uint32_t
+parse_size (const char *arg)
+{
+  char *end;
+  double mb = strtod (arg, &end);
+  double sectors = mb * 1024 * 1024 / PFS_SECTOR_SIZE;
+
+  if (*end != '\0' || mb <= 0 || sectors >= UINT32_MAX)
+    fail ("%s: not a valid size in MB", arg);
+  if (sectors < 3)
+    fail ("%s: too small for a file system", arg);
+  return (uint32_t) sectors;
+}
+
+static void
+usage (int exit_code)
+{
+  printf ("pintos-mkfs, a utility for creating Pintos file system images\n"
+          "Usage: %s [OPTION...] IMAGE [FILE[=NAME]...]\n"
+          "where IMAGE is the file system image to create,\n"
+          "  and each FILE is a host file or directory to copy in.\n"
+          "A directory is copied recursively.  NAME is the path to\n"
+          "use inside the file system (default: last component of FILE,\n"
+          "in the root directory).  Missing directories are created.\n"
+          "Options:\n"
+          "  -s, --size=SIZE   Create an image of SIZE MB (default: 2)\n"
+          "  -v, --verbose     List files as they are added\n"
+          "  -h, --help        Display this help message\n"
+          "Wrap IMAGE into a disk with \"pintos-mkdisk --filesys=IMAGE\"\n"
+          "and boot without -f.\n",
+          program_name);
+  exit (exit_code);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const uint16_t endian_check = 1;
+  const char *image_name = NULL;
+  struct pfs_inode_disk *free_map_inode;
+  uint32_t free_map_data;
+  size_t dir_cnt = 0;
+  struct dir_node *dir;
+  FILE *out;
+  int argi;
+
+  program_name = argv[0];
+  sector_cnt = 2 * 1024 * 1024 / PFS_SECTOR_SIZE;
+  if (*(const uint8_t *) &endian_check != 1)
+    fail ("big-endian hosts are not supported");
+
+  for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++)
+    {
+      const char *arg = argv[argi];
+      if (!strcmp (arg, "-h") || !strcmp (arg, "--help"))
+        usage (EXIT_SUCCESS);
+      else if (!strcmp (arg, "-v") || !strcmp (arg, "--verbose"))
+        verbose = true;
+      else if (!strcmp (arg, "-s") && argi + 1 < argc)
+        sector_cnt = parse_size (argv[++argi]);
+      else if (!strncmp (arg, "--size=", 7))
+        sector_cnt = parse_size (arg + 7);
+      else
+        usage (EXIT_FAILURE);
+    }
+  if (argi >= argc)
+    usage (EXIT_FAILURE);
+  image_name = argv[argi++];
+
+  image = xcalloc (sector_cnt, PFS_SECTOR_SIZE);
+  used_map = xcalloc (pfs_free_map_bytes (sector_cnt), 1);
+
+  /* Lay out the system files the way do_format() does: the free
+     map inode and root directory inode in their fixed sectors,
+     with the free map's data right behind them. */
+  mark_used (PFS_FREE_MAP_SECTOR);
+  mark_used (PFS_ROOT_DIR_SECTOR);
+  next_free = PFS_ROOT_DIR_SECTOR + 1;
+  free_map_data = write_inode (PFS_FREE_MAP_SECTOR, PFS_INODE_MAGIC, NULL,
+                               pfs_free_map_bytes (sector_cnt));
+  root_dir = dir_new (PFS_ROOT_DIR_SECTOR, PFS_ROOT_DIR_SECTOR);
+
+  for (; argi < argc; argi++)
+    add_arg (argv[argi]);
+  write_dirs ();
+
+  /* Everything is allocated, so the free map is final. */
+  free_map_inode = sector_data (PFS_FREE_MAP_SECTOR);
+  memcpy (sector_data (free_map_data), used_map, free_map_inode->length);
+
+  out = fopen (image_name, "wb");
+  if (out == NULL)
+    fail ("%s: create: %s", image_name, strerror (errno));
+  if (fwrite (image, PFS_SECTOR_SIZE, sector_cnt, out) != sector_cnt
+      || fclose (out) != 0)
+    fail ("%s: write failed", image_name);
+
+  for (dir = all_dirs; dir != NULL; dir = dir->next)
+    dir_cnt++;
+  printf ("%s: %zu files, %zu directories, %"PRIu32" of %"PRIu32
+          " sectors used\n", image_name, file_cnt, dir_cnt, next_free,
+          sector_cnt);
+  return EXIT_SUCCESS;
+}
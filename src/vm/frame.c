@@ -3,16 +3,21 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "../threads/loader.h"
 #include "../threads/vaddr.h"
 #include "../lib/debug.h"
 #include "../threads/thread.h"
 #include "../userprog/pagedir.h"
 #include "../threads/interrupt.h"
+#include "../threads/synch.h"
 #include "swap.h"
 #include "page.h"
 #include "../filesys/file.h"
 #include "../userprog/syscall.h"
+#include "../threads/malloc.h"
+#include "../lib/kernel/hash.h"
+#include "writeback.h"
 
 struct lock lock;
 struct frame_entry *frame_table = NULL;
@@ -20,13 +25,82 @@ struct frame_entry *frame_table = NULL;
 uint32_t num_frames_available = 0;
 uint32_t num_frames_total = 0;
 
-int32_t index_of_smallest_score = -1;
+uint32_t num_frames_user = 0;
+
+/* Resident pages, in two second-chance lists with the oldest page
+   at the front: pages of mapped files and executables, which can be
+   read back from their file, and anonymous pages, which need swap. */
+static struct list file_list;
+static struct list anon_list;
+
+/* How strongly reclaim leans towards anonymous pages, 0 to 200.
+   The anon and file lists are scanned in the ratio SWAPPINESS to
+   200 - SWAPPINESS, so the default favours file pages. */
+static unsigned swappiness = 60;
+static unsigned anon_credit, file_credit;
+
+/* Pages looked at per list and victim before settling for the
+   cheapest one seen. */
+#define SCAN_WINDOW 16
+
+/* Read-only pages of executables are shared by every process that
+   maps the same part of the same file.  SHARED_PAGES finds them by
+   inode, offset and the number of bytes read from the file, the
+   rest of the page being zeros; each records its mappings, the reverse map used
+   to unmap the frame everywhere when it is evicted.  The frame table
+   entry names one of the mappings as its owner.
+
+   Anonymous pages a forked process inherits are shared the same way,
+   mapped read-only everywhere until one of the processes writes to
+   its mapping and gets a copy.  These copy-on-write pages are not in
+   SHARED_PAGES, their mappings are the only way to reach them. */
+struct shared_page {
+    struct hash_elem elem;      // in shared_pages, unless cow
+    struct inode *inode;
+    size_t file_offset;
+    size_t read_bytes;
+    void *frame;
+    bool cow;                   // inherited by fork, copied on write
+    struct list mappings;       // of struct rmap_entry
+};
+
+struct rmap_entry {
+    struct list_elem elem;
+    struct thread *thread;
+    uint32_t page;
+};
+
+static struct hash shared_pages;
+
+/* What evicting a page costs, cheapest first. */
+enum eviction_cost {
+    COST_FREE,          // refetchable page, just drop it
+    COST_FILE_WRITE,    // dirty mapped file page, queued write-back
+    COST_SWAP_WRITE     // anonymous page without a current swap copy
+};
 
 #define ONE_MB (1024*1024)
 #define TABLE_INDEX(addr) (vtop(addr - ONE_MB) >> 12)
 #define ADDR_FROM_TABLE_INDEX(idx) (ptov(idx << 12) + ONE_MB)
 
+/* Page-out daemon.  It is woken when the number of free user
+   frames drops below PAGEOUT_LOW and reclaims until PAGEOUT_HIGH
+   frames are free again, so that page faults normally find a free
+   frame without evicting one themselves. */
+#define PAGEOUT_CLUSTER SWAP_CLUSTER /* Dirty pages written per batch. */
+static uint32_t pageout_low;
+static uint32_t pageout_high;
+static struct semaphore pageout_sema;
+static bool pageout_started = false;
+static bool pageout_pending = false;
+
 void do_swapping(void);
+static void *allocate_frame_locked(struct thread *t, enum palloc_flags fgs,
+                                   uint32_t page_addr);
+static void evict_entries(struct frame_entry *fes, uint32_t cnt,
+                          bool unlocked_io);
+static void evict_shared(struct shared_page *sp);
+static void write_back_cluster(struct thread *t, struct spt_entry *se);
 
 void frametable_lock()
 {
@@ -46,44 +120,62 @@ static bool entry_is_empty(struct frame_entry entry)
 
 static struct frame_entry get_entry_to_evict(uint32_t *idx);
 
-static struct frame_entry get_entry_to_evict(uint32_t *idx)
+/* Returns true if the frame at table index IDX has been referenced
+   through either its user or its kernel mapping since the last
+   time the clock hand passed it, and clears both accessed bits. */
+static bool test_and_clear_accessed(uint32_t idx)
 {
-  enum intr_level il = intr_disable();
-  if (index_of_smallest_score != -1)
+  struct frame_entry *entry = &frame_table[idx];
+  void *kernel_addr = ADDR_FROM_TABLE_INDEX(idx);
+  uint32_t *pd = entry->thread->pagedir;
+
+  bool accessed = pagedir_is_accessed(pd, (void *)entry->page)
+                  || pagedir_is_accessed(pd, kernel_addr);
+  if (accessed)
   {
-    *idx = index_of_smallest_score;
-    struct frame_entry entry = frame_table[index_of_smallest_score];
-    // mark as empty entry
-    frame_table[index_of_smallest_score].thread = NULL;
-    index_of_smallest_score = -1;
-    intr_set_level(il);
-    return entry;
+    pagedir_set_accessed(pd, (void *)entry->page, false);
+    pagedir_set_accessed(pd, kernel_addr, false);
   }
 
-
-  int32_t smallest_index = -1;
-  uint8_t smallest_score = UINT8_MAX;
-  for (uint32_t i = 0; i < num_frames_total; i++)
+  // a shared frame is referenced if any of its mappings is
+  if (entry->shared != NULL)
   {
-    struct frame_entry entry = frame_table[i];
-    if (!entry_is_empty(entry) && entry.pinned == false)
+    struct list_elem *e;
+    for (e = list_begin(&entry->shared->mappings);
+         e != list_end(&entry->shared->mappings); e = list_next(e))
     {
-      if (entry.eviction_score < smallest_score)
+      struct rmap_entry *m = list_entry(e, struct rmap_entry, elem);
+      if (pagedir_is_accessed(m->thread->pagedir, (void *)m->page))
       {
-        smallest_score = entry.eviction_score;
-        smallest_index = (int32_t)i;
+        pagedir_set_accessed(m->thread->pagedir, (void *)m->page, false);
+        accessed = true;
       }
     }
   }
+  return accessed;
+}
 
-  struct frame_entry fe = frame_table[smallest_index];
-  frame_table[smallest_index].thread = NULL;
-  frame_table[smallest_index].page = 0;
-  frame_table[smallest_index].eviction_score = 0;
-  frame_table[smallest_index].pinned = false;
-  *idx = smallest_index;
-  intr_set_level(il);
-  return fe;
+static bool select_victim(uint32_t *idx, enum eviction_cost *cost);
+static struct frame_entry take_entry(uint32_t idx);
+
+/* Picks a victim with select_victim() and removes it from the frame
+   table.  Every pass over a list clears the accessed bits it finds,
+   so a victim turns up within a bounded number of passes unless
+   every frame is pinned.  Must be called with the frame table lock
+   held. */
+static struct frame_entry get_entry_to_evict(uint32_t *idx)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  uint32_t passes = 2 * (num_frames_user / SCAN_WINDOW + 1);
+  for (uint32_t pass = 0; pass < passes; pass++)
+  {
+    enum eviction_cost cost;
+    if (select_victim(idx, &cost))
+      return take_entry(*idx);
+  }
+
+  PANIC("no evictable frame, all user frames are pinned");
 }
 
 void *
@@ -96,6 +188,33 @@ allocate_frame(struct thread *t, enum palloc_flags fgs, uint32_t page_addr)
     do_swapping();
   }
 
+  void *u_frame = allocate_frame_locked(t, fgs, page_addr);
+
+  lock_release(&lock);
+
+  return u_frame;
+}
+
+/* Allocates a frame for PAGE_ADDR of T for speculative use, such
+   as swap read-around, but only if free frames are plentiful: it
+   never evicts and returns NULL once the page-out daemon's high
+   watermark would be crossed.  The caller must hold the frame
+   table lock. */
+void *
+allocate_frame_if_free(struct thread *t, uint32_t page_addr)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  if (num_frames_available <= pageout_high)
+    return NULL;
+
+  return allocate_frame_locked(t, 0, page_addr);
+}
+
+static void *
+allocate_frame_locked(struct thread *t, enum palloc_flags fgs,
+                      uint32_t page_addr)
+{
   //allocate
   void *u_frame = palloc_get_page(PAL_USER | fgs);
 
@@ -111,17 +230,25 @@ allocate_frame(struct thread *t, enum palloc_flags fgs, uint32_t page_addr)
 
   ASSERT(entry_is_empty(frame_table[TABLE_INDEX(u_frame)]));
 
-  struct frame_entry e = {
-    .page = page_addr,
-    .thread = t,
-    .eviction_score = 50,
-    .pinned = false
-  };
-  frame_table[TABLE_INDEX(u_frame)] = e;
+  // pages that will be read from a file they are not written back
+  // to anywhere else go on the file list, the rest are anonymous
+  struct spt_entry *se = spt_get_entry(t, page_addr, t->tid);
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(u_frame)];
+  fe->page = page_addr;
+  fe->thread = t;
+  fe->pinned = false;
+  fe->shared = NULL;
+  fe->file_backed = se != NULL && se->spe_status == mapped_file;
+  list_push_back(fe->file_backed ? &file_list : &anon_list, &fe->elem);
 
   num_frames_available--;
 
-  lock_release(&lock);
+  if (pageout_started && !pageout_pending
+      && num_frames_available < pageout_low)
+  {
+    pageout_pending = true;
+    sema_up(&pageout_sema);
+  }
 
   return u_frame;
 }
@@ -129,68 +256,486 @@ allocate_frame(struct thread *t, enum palloc_flags fgs, uint32_t page_addr)
 void do_swapping() {
   uint32_t fe_index;
   struct frame_entry fe = get_entry_to_evict(&fe_index);
+  evict_entries(&fe, 1, false);
+}
 
-  ASSERT(fe.thread != NULL);
-  struct spt_entry *se = spt_get_entry(fe.thread, fe.page, fe.thread->tid);
-  ASSERT(se != NULL);
+/* Returns true if the swapped-in page of SE has not been written
+   to since, so the copy in its old swap slot is still good. */
+static bool swap_copy_is_current(struct thread *t, struct spt_entry *se)
+{
+  return se->swap_slot != SWAP_SLOT_NONE
+         && !pagedir_is_dirty(t->pagedir, (void *)se->vaddr);
+}
 
-  uint32_t *pagedir_swapped_process = fe.thread->pagedir;
+/* Returns what evicting the page in frame FE would cost.  Pages
+   that can be read back from their file or still have a current
+   swap copy are free, as are read-only anonymous pages, which are
+   always untouched zero pages. */
+static enum eviction_cost eviction_cost(const struct frame_entry *fe)
+{
+  struct spt_entry *se = spt_get_entry(fe->thread, fe->page, fe->thread->tid);
+  ASSERT(se != NULL);
 
-//    printf("evicting frame %u (page %p from process \"%s\")%p\n", fe_index,
-//           (void*)fe.page, fe.thread->name, pagedir_swapped_process);
   if (se->spe_status == frame_from_file)
+    return !se->writable
+           || !pagedir_is_dirty(fe->thread->pagedir, (void *)se->vaddr)
+           ? COST_FREE : COST_FILE_WRITE;
+  if (!se->writable || swap_copy_is_current(fe->thread, se))
+    return COST_FREE;
+  return COST_SWAP_WRITE;
+}
+
+/* Looks at up to SCAN_WINDOW pages from the front of LIST.  Pinned
+   pages and pages referenced since the last pass go to the back,
+   the latter losing their accessed bits.  Stops at the first
+   unreferenced page that is free to evict, and otherwise settles for
+   the cheapest unreferenced page seen.  Returns false if every page
+   looked at was pinned or referenced. */
+static bool scan_list(struct list *list, uint32_t *idx,
+                      enum eviction_cost *cost)
+{
+  bool found = false;
+  struct list_elem *e = list_begin(list);
+
+  for (uint32_t step = 0; step < SCAN_WINDOW && e != list_end(list); step++)
   {
-    // write to file, throw out frame
-    // flush to file
-    void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
-    pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
-    se->spe_status = mapped_file;
-    if (se->writable)
+    struct list_elem *next = list_next(e);
+    struct frame_entry *fe = list_entry(e, struct frame_entry, elem);
+    uint32_t i = fe - frame_table;
+
+    if (fe->pinned || test_and_clear_accessed(i))
+    {
+      list_remove(e);
+      list_push_back(list, e);
+    }
+    else
     {
-      bool was_already_locked = fs_lock_held_by_current_thread();
-      if (!was_already_locked) fs_lock();
+      enum eviction_cost c = eviction_cost(fe);
+      if (!found || c < *cost)
+      {
+        found = true;
+        *idx = i;
+        *cost = c;
+        if (c == COST_FREE)
+          break;
+      }
+    }
+    e = next;
+  }
+  return found;
+}
 
-      file_seek(se->file, (int) se->file_offset);
-      file_write(se->file, kernel_addr, (int) se->read_bytes);
+/* Chooses the next page to evict without removing it.  The list
+   whose turn it is by the swappiness ratio is scanned first; unless
+   it offers a page that is free to evict, the other list is scanned
+   too and the cheaper candidate wins, so memory pressure drops
+   cheaply refetched pages before anything needs writing.  Returns
+   false if neither scan found an unreferenced page. */
+static bool select_victim(uint32_t *idx, enum eviction_cost *cost)
+{
+  anon_credit += swappiness;
+  file_credit += 200 - swappiness;
+  bool anon_first = anon_credit > file_credit;
+  if (anon_first)
+    anon_credit -= 200;
+  else
+    file_credit -= 200;
 
-      if (!was_already_locked) fs_unlock();
-    }
+  struct list *first = anon_first ? &anon_list : &file_list;
+  struct list *second = anon_first ? &file_list : &anon_list;
 
+  bool found = scan_list(first, idx, cost);
+  if (found && *cost == COST_FREE)
+    return true;
 
-    free_frame(kernel_addr);
+  uint32_t other_idx;
+  enum eviction_cost other_cost;
+  if (scan_list(second, &other_idx, &other_cost)
+      && (!found || other_cost < *cost))
+  {
+    *idx = other_idx;
+    *cost = other_cost;
+    found = true;
+  }
+  return found;
+}
+
+/* Sets the swappiness, clamped to 0..200. */
+void frame_set_swappiness(unsigned value)
+{
+  swappiness = value > 200 ? 200 : value;
+}
+
+/* Returns the page DIR pages away from E in T's address space if it
+   continues E's mapping in that direction and needs writing back as
+   well: it maps the adjacent part of the same file, is resident and
+   dirty, and is not pinned.  Returns NULL otherwise. */
+static struct spt_entry *
+cluster_neighbour(struct thread *t, struct spt_entry *e, int dir)
+{
+  struct spt_entry *n = spt_get_entry(t, e->vaddr + dir * PGSIZE, t->tid);
+  if (n == NULL || n->spe_status != frame_from_file || n->file != e->file
+      || !n->writable)
+    return NULL;
+
+  // only the last page of a mapping may be partial
+  struct spt_entry *lower = dir > 0 ? e : n;
+  struct spt_entry *upper = dir > 0 ? n : e;
+  if (upper->file_offset != lower->file_offset + PGSIZE
+      || lower->read_bytes != PGSIZE)
+    return NULL;
+
+  if (!pagedir_is_dirty(t->pagedir, (void *)n->vaddr))
+    return NULL;
+  void *kernel_addr = pagedir_get_page(t->pagedir, (void *)n->vaddr);
+  if (frame_table[TABLE_INDEX(kernel_addr)].pinned)
+    return NULL;
+
+  return n;
+}
+
+/* Writes back the dirty mapped file page of SE, which is being
+   evicted, together with the dirty resident pages around it that
+   map the adjacent parts of the same file, as one write of up to
+   WRITEBACK_CLUSTER pages.  The neighbours stay resident but are
+   clean afterwards.  The write goes to the background writer if it
+   can take it and is done right here otherwise. */
+static void write_back_cluster(struct thread *t, struct spt_entry *se)
+{
+  struct spt_entry *first = se;
+  struct spt_entry *last = se;
+  size_t cnt = 1;
+
+  for (struct spt_entry *n; cnt < WRITEBACK_CLUSTER
+       && (n = cluster_neighbour(t, first, -1)) != NULL; cnt++)
+    first = n;
+  for (struct spt_entry *n; cnt < WRITEBACK_CLUSTER
+       && (n = cluster_neighbour(t, last, 1)) != NULL; cnt++)
+    last = n;
+
+  void *pages[WRITEBACK_CLUSTER];
+  for (size_t i = 0; i < cnt; i++)
+  {
+    void *vaddr = (void *)(first->vaddr + i * PGSIZE);
+    pages[i] = pagedir_get_page(t->pagedir, vaddr);
+    // cleared before the copy is made: a later write dirties it again
+    pagedir_set_dirty(t->pagedir, vaddr, false);
   }
-  else if (se->writable && se->spe_status == frame)
+
+  off_t length = (off_t)((cnt - 1) * PGSIZE + last->read_bytes);
+  if (writeback_submit(se->file, (off_t)first->file_offset, pages, cnt,
+                       length))
+    return;
+
+  // an older queued copy of these pages must not land after this one
+  writeback_wait(file_get_inode(se->file), (off_t)first->file_offset, length);
+  for (size_t i = 0; i < cnt; i++)
   {
-    // write to swap
-    void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
-    pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
+    off_t size = i + 1 < cnt ? PGSIZE : (off_t)last->read_bytes;
+    file_write_at(se->file, pages[i], size,
+                  (off_t)(first->file_offset + i * PGSIZE));
+  }
+}
+
+/* Unmaps the shared page SP from every process that maps it, turning
+   their pages back into unread file pages, and frees its frame. */
+static void evict_shared(struct shared_page *sp)
+{
+  ASSERT(!sp->cow);
+
+  while (!list_empty(&sp->mappings))
+  {
+    struct rmap_entry *m = list_entry(list_pop_front(&sp->mappings),
+                                      struct rmap_entry, elem);
+    struct spt_entry *se = spt_get_entry(m->thread, m->page, m->thread->tid);
+    ASSERT(se != NULL && se->spe_status == frame_from_file);
+    pagedir_clear_page(m->thread->pagedir, (void *)m->page);
+    se->spe_status = mapped_file;
+    free(m);
+  }
+
+  hash_delete(&shared_pages, &sp->elem);
+  void *frame = sp->frame;
+  free(sp);
+  free_frame(frame);
+}
+
+/* Returns the swap slot all mappings of the copy-on-write page SP
+   hold.  None of them can have written to the page, so a copy there
+   is current. */
+static size_t cow_slot(struct shared_page *sp)
+{
+  struct rmap_entry *owner = list_entry(list_front(&sp->mappings),
+                                        struct rmap_entry, elem);
+  struct spt_entry *se = spt_get_entry(owner->thread, owner->page,
+                                       owner->thread->tid);
+  ASSERT(se != NULL);
+  return se->swap_slot;
+}
+
+/* Unmaps the copy-on-write page SP from every process that maps it,
+   leaving their pages in swap slot SLOT, and frees SP but not its
+   frame.  If NEW_SLOT, SLOT has just been allocated with a single
+   holder and each further mapping takes a reference to it. */
+static void unmap_cow(struct shared_page *sp, size_t slot, bool new_slot)
+{
+  bool first = true;
+
+  while (!list_empty(&sp->mappings))
+  {
+    struct rmap_entry *m = list_entry(list_pop_front(&sp->mappings),
+                                      struct rmap_entry, elem);
+    struct spt_entry *se = spt_get_entry(m->thread, m->page, m->thread->tid);
+    ASSERT(se != NULL && se->spe_status == frame);
+    if (new_slot && !first)
+      swap_dup(slot);
+    first = false;
+    pagedir_clear_page(m->thread->pagedir, (void *)m->page);
     se->spe_status = swap;
-    uint32_t swap_id = frame_to_swap(kernel_addr);
-    se->swap_slot = swap_id;
-//    printf("wrote to swap slot %u\n", swap_id);
-    free_frame(kernel_addr);
+    se->swap_slot = slot;
+    free(m);
   }
-  else {
-    ASSERT(0);
+  free(sp);
+}
+
+/* Writes back the CNT pages held by FES, which have already been
+   removed from the frame table, and releases their frames.  Pages
+   that go to swap are written together as one cluster.  They are
+   unmapped and given their slots first, so if UNLOCKED_IO is true
+   the frame table lock is dropped during the write: anyone faulting
+   them back in meanwhile waits in swap_to_frames() until the write
+   is done. */
+static void evict_entries(struct frame_entry *fes, uint32_t cnt,
+                          bool unlocked_io)
+{
+  ASSERT(cnt <= SWAP_CLUSTER);
+
+  void *swap_frames[SWAP_CLUSTER];
+  struct spt_entry *swap_entries[SWAP_CLUSTER];
+  struct shared_page *swap_cow[SWAP_CLUSTER];
+  size_t swap_slots[SWAP_CLUSTER];
+  size_t swap_cnt = 0;
+
+  for (uint32_t i = 0; i < cnt; i++)
+  {
+    struct frame_entry fe = fes[i];
+    ASSERT(fe.thread != NULL);
+    if (fe.shared != NULL && fe.shared->cow)
+    {
+      struct shared_page *sp = fe.shared;
+      size_t slot = cow_slot(sp);
+      if (slot == SWAP_SLOT_NONE)
+      {
+        // written once for all mappings, with the rest of the batch
+        swap_frames[swap_cnt] = sp->frame;
+        swap_entries[swap_cnt] = NULL;
+        swap_cow[swap_cnt] = sp;
+        swap_cnt++;
+      }
+      else
+      {
+        void *kernel_addr = sp->frame;
+        unmap_cow(sp, slot, false);
+        free_frame(kernel_addr);
+      }
+      continue;
+    }
+    if (fe.shared != NULL)
+    {
+      evict_shared(fe.shared);
+      continue;
+    }
+    struct spt_entry *se = spt_get_entry(fe.thread, fe.page, fe.thread->tid);
+    ASSERT(se != NULL);
+
+    uint32_t *pagedir_swapped_process = fe.thread->pagedir;
+
+//    printf("evicting frame (page %p from process \"%s\")%p\n",
+//           (void*)fe.page, fe.thread->name, pagedir_swapped_process);
+    if (se->spe_status == frame_from_file)
+    {
+      // write to file only if it changed, throw out frame
+      void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
+      if (se->writable
+          && pagedir_is_dirty(pagedir_swapped_process, (void *)se->vaddr))
+        write_back_cluster(fe.thread, se);
+      pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
+      se->spe_status = mapped_file;
+      free_frame(kernel_addr);
+    }
+    else if (!se->writable && se->spe_status == frame)
+    {
+      // read-only anonymous pages are never written, so this is
+      // still the zero page it started as
+      void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
+      pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
+      se->spe_status = zeroes;
+      free_frame(kernel_addr);
+    }
+    else if (se->writable && se->spe_status == frame
+             && swap_copy_is_current(fe.thread, se))
+    {
+      // unchanged since it was swapped in, its slot still holds it
+      void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
+      pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
+      se->spe_status = swap;
+      free_frame(kernel_addr);
+    }
+    else if (se->writable && se->spe_status == frame)
+    {
+      // write to swap, together with the rest of the batch
+      void *kernel_addr = pagedir_get_page(pagedir_swapped_process, (void*)se->vaddr);
+      pagedir_clear_page(pagedir_swapped_process, (void *)se->vaddr);
+      se->spe_status = swap;
+      if (se->swap_slot != SWAP_SLOT_NONE)
+        set_swap_index(se->swap_slot, false);
+      swap_frames[swap_cnt] = kernel_addr;
+      swap_entries[swap_cnt] = se;
+      swap_cow[swap_cnt] = NULL;
+      swap_cnt++;
+    }
+    else {
+      ASSERT(0);
+    }
   }
+
+  if (swap_cnt == 0)
+    return;
+
+  swap_alloc_slots(swap_cnt, swap_slots);
+  for (size_t i = 0; i < swap_cnt; i++)
+  {
+    if (swap_cow[i] != NULL)
+      unmap_cow(swap_cow[i], swap_slots[i], true);
+    else
+      swap_entries[i]->swap_slot = swap_slots[i];
+  }
+
+  swap_write_begin();
+  if (unlocked_io)
+    lock_release(&lock);
+  swap_write_end(swap_frames, swap_cnt, swap_slots);
+  if (unlocked_io)
+    lock_acquire(&lock);
+
+  for (size_t i = 0; i < swap_cnt; i++)
+    free_frame(swap_frames[i]);
 }
 
 void free_frame(void *frame)
 {
-  struct frame_entry e = {
-    .page = 0,
-    .thread = NULL,
-    .eviction_score = 0,
-    .pinned = false
-  };
+  // also called when a process gives up its pages
+  bool was_already_locked = lock_held_by_current_thread(&lock);
+  if (!was_already_locked) lock_acquire(&lock);
 
-  frame_table[TABLE_INDEX(frame)] = e;
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(frame)];
+  if (!entry_is_empty(*fe))
+    list_remove(&fe->elem);
+  fe->page = 0;
+  fe->thread = NULL;
+  fe->pinned = false;
+  fe->shared = NULL;
 
   palloc_free_page(frame);
 
   num_frames_available++;
+
+  if (!was_already_locked) lock_release(&lock);
+}
+
+
+/* Removes the frame at table index IDX from the frame table and
+   returns its entry, ready to be passed to evict_entries(). */
+static struct frame_entry take_entry(uint32_t idx)
+{
+  struct frame_entry fe = frame_table[idx];
+  ASSERT(!entry_is_empty(fe));
+  list_remove(&frame_table[idx].elem);
+  frame_table[idx].thread = NULL;
+  frame_table[idx].page = 0;
+  frame_table[idx].pinned = false;
+  return fe;
 }
 
+/* One reclaim pass of the page-out daemon.  Takes victims from
+   select_victim() until the high watermark would be reached, at
+   most PAGEOUT_CLUSTER of them that need writing.  Free ones are
+   dropped right away, the others are written back as one batch, with
+   the frame table lock released while they go to swap.  Returns the
+   number of frames freed. */
+static uint32_t pageout_reclaim(void)
+{
+  struct frame_entry victims[PAGEOUT_CLUSTER];
+  uint32_t victim_cnt = 0;
+  uint32_t freed = 0;
+  uint32_t misses = 0;
+
+  while (num_frames_available + victim_cnt < pageout_high
+         && victim_cnt < PAGEOUT_CLUSTER && misses < 4)
+  {
+    uint32_t i;
+    enum eviction_cost cost;
+    if (!select_victim(&i, &cost))
+    {
+      // the scan cleared accessed bits, so retrying can succeed
+      misses++;
+      continue;
+    }
+
+    struct frame_entry victim = take_entry(i);
+    if (cost == COST_FREE)
+    {
+      evict_entries(&victim, 1, true);
+      freed++;
+    }
+    else
+      victims[victim_cnt++] = victim;
+  }
+
+  evict_entries(victims, victim_cnt, true);
+  return freed + victim_cnt;
+}
+
+static void pageout_daemon(void *aux UNUSED)
+{
+  for (;;)
+  {
+    sema_down(&pageout_sema);
+
+    lock_acquire(&lock);
+    while (num_frames_available < pageout_high)
+      if (pageout_reclaim() == 0)
+        break;
+    pageout_pending = false;
+    lock_release(&lock);
+  }
+}
+
+void frame_pageout_init()
+{
+  sema_init(&pageout_sema, 0);
+  pageout_started = thread_create("pageout", PRI_DEFAULT, pageout_daemon,
+                                  "system") != TID_ERROR;
+}
+
+static unsigned shared_page_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct shared_page *sp = hash_entry(e, struct shared_page, elem);
+  return hash_int((int)(uintptr_t)sp->inode ^ (int)sp->file_offset
+                  ^ (int)sp->read_bytes);
+}
+
+static bool shared_page_less(const struct hash_elem *a,
+                             const struct hash_elem *b, void *aux UNUSED)
+{
+  const struct shared_page *x = hash_entry(a, struct shared_page, elem);
+  const struct shared_page *y = hash_entry(b, struct shared_page, elem);
+  if (x->inode != y->inode)
+    return (uintptr_t)x->inode < (uintptr_t)y->inode;
+  if (x->file_offset != y->file_offset)
+    return x->file_offset < y->file_offset;
+  return x->read_bytes < y->read_bytes;
+}
 
 static uint32_t divide_round_up(uint32_t a, uint32_t b)
 {
@@ -203,6 +748,15 @@ void frame_table_init(uint32_t num_user_frames, uint32_t num_total_frames)
 
   num_frames_available = num_user_frames;
   num_frames_total = num_total_frames;
+  num_frames_user = num_user_frames;
+  list_init(&file_list);
+  list_init(&anon_list);
+  hash_init(&shared_pages, shared_page_hash, shared_page_less, NULL);
+
+  pageout_low = num_user_frames / 32;
+  if (pageout_low < 4)
+    pageout_low = 4;
+  pageout_high = pageout_low * 2;
   // we only keep track of user frames, but due to our addressing strategy,
   // the table still needs to be large enough to hold all frames
   uint32_t table_size_bytes = sizeof(struct frame_entry) * num_frames_total;
@@ -213,59 +767,272 @@ void frame_table_init(uint32_t num_user_frames, uint32_t num_total_frames)
 
 void set_pinned(void* frame)
 {
-  uint32_t index = TABLE_INDEX(frame);
-  struct frame_entry fe = frame_table[index];
-
-  ASSERT(!entry_is_empty(fe));
-  fe.pinned = true;
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(frame)];
 
-  if ((int32_t)index == index_of_smallest_score)
-    compute_eviction_score();
+  ASSERT(!entry_is_empty(*fe));
+  fe->pinned = true;
 }
 
 void unpin(void* frame)
 {
-  uint32_t index = TABLE_INDEX(frame);
-  struct frame_entry fe = frame_table[index];
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(frame)];
 
-  ASSERT(!entry_is_empty(fe));
-  fe.pinned = false;
+  ASSERT(!entry_is_empty(*fe));
+  fe->pinned = false;
+}
+
+/* Returns true if the page of SE may be shared with other processes
+   mapping the same part of the same file: a not yet loaded read-only
+   page, which only executables' text and read-only data have. */
+static bool is_shareable(struct spt_entry *se)
+{
+  return se->spe_status == mapped_file && !se->writable;
+}
+
+static struct shared_page *shared_page_lookup(struct spt_entry *se)
+{
+  struct shared_page key = {
+    .inode = file_get_inode(se->file),
+    .file_offset = se->file_offset,
+    .read_bytes = se->read_bytes
+  };
+  struct hash_elem *e = hash_find(&shared_pages, &key.elem);
+  return e != NULL ? hash_entry(e, struct shared_page, elem) : NULL;
+}
+
+static bool add_mapping(struct shared_page *sp, struct thread *t,
+                        uint32_t page_addr)
+{
+  struct rmap_entry *m = malloc(sizeof *m);
+  if (m == NULL)
+    return false;
+  m->thread = t;
+  m->page = page_addr;
+  list_push_back(&sp->mappings, &m->elem);
+  return true;
 }
 
-void compute_eviction_score()
+/* If another process already has the page of SE in a shared frame,
+   maps that frame read-only into T and returns true.  Otherwise
+   returns false and the page has to be read in as usual.  Must be
+   called with the frame table lock held. */
+bool frame_map_shared(struct thread *t, struct spt_entry *se)
 {
-  int32_t smallest_index = -1;
-  uint8_t smallest_score = UINT8_MAX;
-  for (uint32_t i = 0; i < num_frames_total; i++)
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  if (!is_shareable(se))
+    return false;
+  struct shared_page *sp = shared_page_lookup(se);
+  if (sp == NULL || !add_mapping(sp, t, se->vaddr))
+    return false;
+
+  if (!pagedir_set_page(t->pagedir, (void *)se->vaddr, sp->frame, false))
+  {
+    struct rmap_entry *m = list_entry(list_pop_back(&sp->mappings),
+                                      struct rmap_entry, elem);
+    free(m);
+    return false;
+  }
+  se->spe_status = frame_from_file;
+  return true;
+}
+
+/* Offers FRAME, into which T has just read the page of SE, to other
+   processes that map the same page.  Does nothing if the page is not
+   shareable or memory for the bookkeeping is short.  Must be called
+   with the frame table lock held, before SE's status changes. */
+void frame_share(struct thread *t, struct spt_entry *se, void *frame)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  if (!is_shareable(se) || shared_page_lookup(se) != NULL)
+    return;
+
+  struct shared_page *sp = malloc(sizeof *sp);
+  if (sp == NULL)
+    return;
+  sp->inode = file_get_inode(se->file);
+  sp->file_offset = se->file_offset;
+  sp->read_bytes = se->read_bytes;
+  sp->frame = frame;
+  sp->cow = false;
+  list_init(&sp->mappings);
+  if (!add_mapping(sp, t, se->vaddr))
+  {
+    free(sp);
+    return;
+  }
+
+  hash_insert(&shared_pages, &sp->elem);
+  frame_table[TABLE_INDEX(frame)].shared = sp;
+}
+
+/* Removes T's mapping at PAGE_ADDR of FRAME if FRAME is shared,
+   freeing the frame once nobody maps it any more, and returns true.
+   Returns false, doing nothing, for a private frame.  Must be called
+   with the frame table lock held. */
+bool frame_unshare(struct thread *t, uint32_t page_addr, void *frame)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(frame)];
+  struct shared_page *sp = fe->shared;
+  if (sp == NULL)
+    return false;
+
+  struct list_elem *e;
+  for (e = list_begin(&sp->mappings); e != list_end(&sp->mappings);
+       e = list_next(e))
   {
-    struct frame_entry entry = frame_table[i];
-    if (!entry_is_empty(entry) && entry.pinned == false)
+    struct rmap_entry *m = list_entry(e, struct rmap_entry, elem);
+    if (m->thread == t && m->page == page_addr)
     {
-      void *kernel_addr = ADDR_FROM_TABLE_INDEX(i);
-      // check user address and kernel address
-      if (pagedir_is_accessed(entry.thread->pagedir, (void*)entry.page)
-      ||  pagedir_is_accessed(entry.thread->pagedir, kernel_addr))
-      {
-        pagedir_set_accessed(entry.thread->pagedir, (void*)entry.page, false);
-        pagedir_set_accessed(entry.thread->pagedir, kernel_addr, false);
+      list_remove(e);
+      free(m);
+      break;
+    }
+  }
+  pagedir_clear_page(t->pagedir, (void *)page_addr);
 
-        if (entry.eviction_score < UINT8_MAX)
-          entry.eviction_score++;
-      }
-      else
-      {
-        if (entry.eviction_score > 0)
-        {
-          entry.eviction_score--;
-        }
-      }
-      if (entry.eviction_score < smallest_score)
-      {
-        smallest_score = entry.eviction_score;
-        smallest_index = (int32_t)i;
-      }
+  if (list_empty(&sp->mappings))
+  {
+    if (!sp->cow)
+      hash_delete(&shared_pages, &sp->elem);
+    free(sp);
+    free_frame(frame);
+  }
+  else if (fe->thread == t && fe->page == page_addr)
+  {
+    // hand ownership to a remaining mapping
+    struct rmap_entry *m = list_entry(list_front(&sp->mappings),
+                                      struct rmap_entry, elem);
+    fe->thread = m->thread;
+    fe->page = m->page;
+  }
+  return true;
+}
+
+/* Replaces T's mapping of PAGE_ADDR by one to FRAME with the given
+   access.  The page table already exists, so this cannot fail for
+   lack of memory. */
+static void remap(struct thread *t, uint32_t page_addr, void *frame,
+                  bool writable)
+{
+  pagedir_clear_page(t->pagedir, (void *)page_addr);
+  if (!pagedir_set_page(t->pagedir, (void *)page_addr, frame, writable))
+    PANIC("out of memory remapping page");
+}
+
+/* Lets CHILD, being forked from PARENT, share the resident writable
+   anonymous page of PSE copy-on-write: the frame is mapped read-only
+   into both, and CSE, CHILD's entry for the page, inherits PSE's swap
+   slot.  Returns false if memory for the bookkeeping is short, in
+   which case CSE is left alone.  Must be called with the frame table
+   lock held. */
+bool frame_cow_share(struct thread *parent, struct spt_entry *pse,
+                     struct thread *child, struct spt_entry *cse)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+  ASSERT(pse->spe_status == frame && pse->writable);
+
+  void *kpage = pagedir_get_page(parent->pagedir, (void *)pse->vaddr);
+  ASSERT(kpage != NULL);
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(kpage)];
+  struct shared_page *sp = fe->shared;
+
+  if (sp == NULL)
+  {
+    sp = malloc(sizeof *sp);
+    if (sp == NULL)
+      return false;
+    sp->inode = NULL;
+    sp->file_offset = 0;
+    sp->read_bytes = 0;
+    sp->frame = kpage;
+    sp->cow = true;
+    list_init(&sp->mappings);
+    if (!add_mapping(sp, parent, pse->vaddr))
+    {
+      free(sp);
+      return false;
     }
+
+    // the slot must stay valid for every mapping from now on
+    if (pse->swap_slot != SWAP_SLOT_NONE && !swap_copy_is_current(parent, pse))
+    {
+      set_swap_index(pse->swap_slot, false);
+      pse->swap_slot = SWAP_SLOT_NONE;
+    }
+    remap(parent, pse->vaddr, kpage, false);
+    fe->shared = sp;
   }
+  ASSERT(sp->cow);
 
-  index_of_smallest_score = smallest_index;
-}
\ No newline at end of file
+  if (!add_mapping(sp, child, cse->vaddr))
+    return false;
+  if (!pagedir_set_page(child->pagedir, (void *)cse->vaddr, kpage, false))
+  {
+    struct rmap_entry *m = list_entry(list_pop_back(&sp->mappings),
+                                      struct rmap_entry, elem);
+    free(m);
+    return false;
+  }
+
+  cse->spe_status = frame;
+  cse->swap_slot = pse->swap_slot;
+  if (cse->swap_slot != SWAP_SLOT_NONE)
+    swap_dup(cse->swap_slot);
+  return true;
+}
+
+/* Handles T's write to the page of SE that faulted although the page
+   is present.  If the page is copy-on-write, T gets a private copy it
+   may write to, or just write access to the frame if nobody else maps
+   it any more, and true is returned.  Returns false if the write is a
+   genuine rights violation.  Must be called with the frame table lock
+   held. */
+bool frame_cow_break(struct thread *t, struct spt_entry *se)
+{
+  ASSERT(lock_held_by_current_thread(&lock));
+
+  // evicted since the fault, retrying the write faults it back in
+  if (se->spe_status == swap && se->writable)
+    return true;
+  if (se->spe_status != frame || !se->writable)
+    return false;
+
+  void *kpage = pagedir_get_page(t->pagedir, (void *)se->vaddr);
+  ASSERT(kpage != NULL);
+  struct frame_entry *fe = &frame_table[TABLE_INDEX(kpage)];
+  struct shared_page *sp = fe->shared;
+  if (sp == NULL || !sp->cow)
+    return false;
+
+  if (list_size(&sp->mappings) == 1)
+  {
+    // the others have made their copies already, the frame is ours
+    free(list_entry(list_pop_front(&sp->mappings), struct rmap_entry, elem));
+    free(sp);
+    fe->shared = NULL;
+    fe->thread = t;
+    fe->page = se->vaddr;
+    remap(t, se->vaddr, kpage, true);
+    return true;
+  }
+
+  // keep the original resident while it is being copied
+  bool was_pinned = fe->pinned;
+  fe->pinned = true;
+  if (num_frames_available <= 1)
+    do_swapping();
+  void *copy = allocate_frame_locked(t, 0, se->vaddr);
+  memcpy(copy, kpage, PGSIZE);
+  fe->pinned = was_pinned;
+
+  frame_unshare(t, se->vaddr, kpage);
+  if (!pagedir_set_page(t->pagedir, (void *)se->vaddr, copy, true))
+    PANIC("out of memory mapping copied page");
+  // the copy equals the swap slot's contents until written, which
+  // swap_copy_is_current() tells from the dirty bit as usual
+  return true;
+}
@@ -1,8 +1,11 @@
 
 #include <filesys/off_t.h>
 #include <stdbool.h>
+#include <list.h>
 
 struct thread;
+struct spt_entry;
+struct shared_page;
 enum palloc_flags;
 
 
@@ -10,20 +13,32 @@ struct frame_entry {
     uint32_t page;
     struct thread *thread;
     bool pinned;
-    uint8_t eviction_score;
+    bool file_backed;           // on the file list, else the anon list
+    struct shared_page *shared; // if mapped by several processes
+    struct list_elem elem;      // in its replacement list while resident
 };
 
 void *
 allocate_frame(struct thread *t, enum palloc_flags fgs, uint32_t page_addr);
 
+void *allocate_frame_if_free(struct thread *t, uint32_t page_addr);
+
 void free_frame(void *page);
 
 void frame_table_init(uint32_t num_user_frames, uint32_t num_total_frames);
-
-void compute_eviction_score(void);
+void frame_pageout_init(void);
+void frame_set_swappiness(unsigned swappiness);
 
 void frametable_lock(void);
 void frametable_unlock(void);
 
 void set_pinned(void* frame);
-void unpin(void* frame);
\ No newline at end of file
+void unpin(void* frame);
+
+bool frame_map_shared(struct thread *t, struct spt_entry *se);
+void frame_share(struct thread *t, struct spt_entry *se, void *frame);
+bool frame_unshare(struct thread *t, uint32_t page_addr, void *frame);
+
+bool frame_cow_share(struct thread *parent, struct spt_entry *pse,
+                     struct thread *child, struct spt_entry *cse);
+bool frame_cow_break(struct thread *t, struct spt_entry *se);
\ No newline at end of file
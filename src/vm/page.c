@@ -76,6 +76,7 @@ static struct spt_entry *_spt_entry(struct hash *spt, uint32_t vaddr, pid_t pid,
   e->vaddr = vaddr;
   e->spe_status = spe_status;
   e->writable = writable;
+  e->swap_slot = SWAP_SLOT_NONE;
 
   hash_insert(spt, &e->elem);
 
@@ -163,8 +164,14 @@ _spt_remove_entry(uint32_t vaddr, struct thread *t, const struct spt_entry *e) {
     // only need to free a frame if we allocated one.
     void *paddr = pagedir_get_page(t->pagedir, (void *)vaddr);
     ASSERT(paddr != NULL);
-    pagedir_clear_page(t->pagedir, (void *)vaddr);
-    free_frame((void *)paddr);
+    if (!frame_unshare(t, vaddr, paddr))
+    {
+      pagedir_clear_page(t->pagedir, (void *)vaddr);
+      free_frame((void *)paddr);
+    }
+    // a page swapped back in may still own its old slot
+    if (e->swap_slot != SWAP_SLOT_NONE)
+      set_swap_index(e->swap_slot, false);
   } else if (e->spe_status == swap) {
       //remove from swap part.
     set_swap_index(e->swap_slot, false);
@@ -191,5 +198,82 @@ static void spt_terminate_func(struct hash_elem *elem, void *aux UNUSED)
 
 void spt_destroy(struct hash *spt)
 {
+    // keep the page-out daemon from evicting pages as they go away
+    frametable_lock();
     hash_destroy(spt, spt_terminate_func);
-}
\ No newline at end of file
+    frametable_unlock();
+}
+/* Returns CHILD's counterpart of PARENT's FILE, which backs pages of
+   PARENT's executable or of one of its mapped files. */
+static struct file *fork_file(struct thread *parent, struct thread *child,
+                              struct file *file)
+{
+  if (file == parent->exec_file)
+    return child->exec_file;
+
+  struct list_elem *p = list_begin(&parent->mapped_files);
+  struct list_elem *c = list_begin(&child->mapped_files);
+  for (; p != list_end(&parent->mapped_files);
+       p = list_next(p), c = list_next(c))
+  {
+    ASSERT(c != list_end(&child->mapped_files));
+    if (list_entry(p, struct m_file, list_elem)->file == file)
+      return list_entry(c, struct m_file, list_elem)->file;
+  }
+  NOT_REACHED();
+}
+
+/* Copies PARENT's supplemental page table into CHILD, which is being
+   forked from it.  Resident writable anonymous pages are shared
+   copy-on-write, pages in swap share their slot, and file pages are
+   read in again on demand, through CHILD's own copies of the
+   executable and the mapped files.  Those must be set up already,
+   mapped files in the same order as PARENT's, and dirty mapped pages
+   must have been written back.  Returns false if memory runs out. */
+bool spt_fork(struct thread *parent, struct thread *child)
+{
+  struct hash_iterator i;
+  bool success = true;
+
+  frametable_lock();
+  hash_first(&i, &parent->spt);
+  while (success && hash_next(&i))
+  {
+    struct spt_entry *pse = hash_entry(hash_cur(&i), struct spt_entry, elem);
+    struct spt_entry *cse = _spt_entry(&child->spt, pse->vaddr, child->tid,
+                                       0, pse->writable, pse->spe_status);
+    if (cse == NULL)
+    {
+      success = false;
+      break;
+    }
+
+    switch (pse->spe_status)
+    {
+      case frame_from_file:
+      case mapped_file:
+      case mapped_file_nowriteback:
+        cse->file = fork_file(parent, child, pse->file);
+        cse->file_offset = pse->file_offset;
+        cse->read_bytes = pse->read_bytes;
+        if (pse->spe_status == frame_from_file)
+          cse->spe_status = mapped_file;
+        break;
+      case swap:
+        cse->swap_slot = pse->swap_slot;
+        swap_dup(cse->swap_slot);
+        break;
+      case frame:
+        // read-only anonymous pages are still zero pages
+        cse->spe_status = zeroes;
+        if (pse->writable && !frame_cow_share(parent, pse, child, cse))
+          success = false;
+        break;
+      case zeroes:
+        break;
+    }
+  }
+  frametable_unlock();
+
+  return success;
+}
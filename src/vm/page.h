@@ -39,7 +39,9 @@ struct spt_entry {
 
     size_t  read_bytes;
 
-    size_t swap_slot;
+    size_t swap_slot;       // SWAP_SLOT_NONE if the page has no copy
+                            // in swap; a resident page keeps the slot
+                            // it was read from until it is written to
 
     bool writable;
 
@@ -73,4 +75,6 @@ bool spt_file_overlaping(uint32_t addr, off_t file_size, pid_t pid);
 
 void spt_remove_entry(uint32_t vaddr, struct thread *t);
 
-void spt_destroy(struct hash *);
\ No newline at end of file
+void spt_destroy(struct hash *);
+
+bool spt_fork(struct thread *parent, struct thread *child);
\ No newline at end of file
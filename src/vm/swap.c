@@ -6,7 +6,11 @@
 #include <lib/kernel/bitmap.h>
 #include <devices/block.h>
 #include <threads/vaddr.h>
+#include <threads/malloc.h>
+#include <threads/palloc.h>
+#include <threads/synch.h>
 #include <stdio.h>
+#include "zswap.h"
 
 #define SECTORS_PER_SLOT (PGSIZE / BLOCK_SECTOR_SIZE)
 
@@ -15,56 +19,212 @@
 struct bitmap *slots_occupied;
 struct block *device;
 
-void swap_init() {
+// processes holding each occupied slot; forked processes share the
+// slots of the pages they inherited
+static uint16_t *slot_refs;
+
+// protects the slot bitmap and the compressed tier
+static struct lock swap_lock;
+
+// pages pushed out of the compressed tier are decompressed here on
+// their way to disk
+static void *bounce_page;
+
+/* Sets up the swap device, with a compressed in-memory tier of
+   ZSWAP_PAGES kernel pages in front of it, or none if 0. */
+void swap_init(size_t zswap_pages) {
   device = block_get_role(BLOCK_SWAP);
   ASSERT(device != NULL);
 
+  lock_init(&swap_lock);
+
   uint32_t swap_size = block_size(device) * BLOCK_SECTOR_SIZE;
   uint32_t num_slots = swap_size / PGSIZE;
   slots_occupied = bitmap_create(num_slots);
+  slot_refs = calloc(num_slots, sizeof *slot_refs);
+  ASSERT(slots_occupied != NULL && slot_refs != NULL);
+
+  if (zswap_pages > 0)
+    bounce_page = palloc_get_page(0);
+  zswap_init(num_slots, bounce_page != NULL ? zswap_pages : 0);
 }
 
+/* Marks SLOT as used by one holder, or drops one holder's reference
+   to it.  The slot is freed when its last holder lets go. */
 void set_swap_index(size_t slot, bool value)
 {
-  bitmap_set(slots_occupied, slot, value);
+  lock_acquire(&swap_lock);
+  if (value)
+    slot_refs[slot] = 1;
+  else
+  {
+    ASSERT(slot_refs[slot] > 0);
+    if (--slot_refs[slot] == 0)
+      zswap_drop(slot);
+  }
+  bitmap_set(slots_occupied, slot, slot_refs[slot] > 0);
+  lock_release(&swap_lock);
+}
+
+/* Adds a holder to the occupied SLOT, which is then freed only once
+   both have released it with set_swap_index(). */
+void swap_dup(size_t slot)
+{
+  lock_acquire(&swap_lock);
+  ASSERT(bitmap_test(slots_occupied, slot) && slot_refs[slot] < UINT16_MAX);
+  slot_refs[slot]++;
+  lock_release(&swap_lock);
+}
+
+// next-fit: allocation resumes where the previous one ended, so that
+// pages swapped out one after the other end up next to each other
+static size_t cursor;
+
+/* Allocates CNT consecutive free slots and returns the first, or
+   BITMAP_ERROR if there is no such run. */
+static size_t swap_alloc(size_t cnt)
+{
+  size_t slot = bitmap_scan_and_flip(slots_occupied, cursor, cnt, false);
+  if (slot == BITMAP_ERROR && cursor != 0)
+    slot = bitmap_scan_and_flip(slots_occupied, 0, cnt, false);
+  if (slot == BITMAP_ERROR)
+    return BITMAP_ERROR;
+
+  for (size_t i = 0; i < cnt; i++)
+    slot_refs[slot + i] = 1;
+
+  cursor = slot + cnt;
+  if (cursor >= bitmap_size(slots_occupied))
+    cursor = 0;
+  return slot;
 }
 
 size_t frame_to_swap(void *addr) {
-  size_t free_slot = bitmap_scan(slots_occupied, 0, 1, false);
-  if (free_slot == BITMAP_ERROR)
-  {
-    // out of swap space
-    ASSERT(0);
-  }
+  size_t slot;
+  frames_to_swap(&addr, 1, &slot);
+  return slot;
+}
 
-  // write out every sector that makes up this slot
-  for (uint32_t i = 0; i < SECTORS_PER_SLOT; i++) {
-    block_sector_t sector_number = (free_slot * SECTORS_PER_SLOT) + i;
-    void *target = addr + (i * BLOCK_SECTOR_SIZE);
+/* Writes the CNT pages at FRAMES to swap and stores the slot of
+   FRAMES[i] in SLOTS[i]. */
+void frames_to_swap(void **frames, size_t cnt, size_t *slots) {
+  swap_alloc_slots(cnt, slots);
+  swap_write_begin();
+  swap_write_end(frames, cnt, slots);
+}
 
-    block_write(device, sector_number, target);
+/* Allocates a slot for each of CNT pages and stores them in SLOTS,
+   a run of adjacent slots if one is free.  Each slot starts out
+   with one holder.  The pages must be written with
+   swap_write_begin() and swap_write_end() before anyone can read
+   them back. */
+void swap_alloc_slots(size_t cnt, size_t *slots) {
+  ASSERT(cnt <= SWAP_CLUSTER);
+
+  lock_acquire(&swap_lock);
+  size_t first = swap_alloc(cnt);
+  for (size_t i = 0; i < cnt; i++)
+  {
+    slots[i] = first != BITMAP_ERROR ? first + i : swap_alloc(1);
+    if (slots[i] == BITMAP_ERROR)
+      PANIC("out of swap space");
   }
+  lock_release(&swap_lock);
+}
 
-  bitmap_set(slots_occupied, free_slot, true);
+/* Starts a write to swap.  Until the matching swap_write_end(),
+   reads from swap wait, so a caller may publish the new slots and
+   drop its own locks before doing the I/O. */
+void swap_write_begin(void) {
+  lock_acquire(&swap_lock);
+}
 
-  uint32_t slots = bitmap_count(slots_occupied, 0, bitmap_size(slots_occupied),
-                                false);
-  //printf("swap slots left: %u\n", slots);
+/* Writes the CNT pages at FRAMES to their SLOTS and ends the write
+   begun with swap_write_begin().  Pages that compress well are kept
+   in the compressed tier; the rest are written to disk, all queued
+   before waiting for any of them so the block layer can merge them
+   into one transfer. */
+void swap_write_end(void **frames, size_t cnt, const size_t *slots) {
+  ASSERT(cnt <= SWAP_CLUSTER);
+  ASSERT(lock_held_by_current_thread(&swap_lock));
+
+  struct block_request requests[SWAP_CLUSTER];
+  size_t request_cnt = 0;
+  for (size_t i = 0; i < cnt; i++)
+  {
+    enum zswap_result result;
+    while ((result = zswap_store(slots[i], frames[i])) == ZSWAP_FULL)
+    {
+      // the oldest compressed page goes to disk to make room
+      size_t victim = zswap_evict(bounce_page);
+      block_write_multiple(device, victim * SECTORS_PER_SLOT,
+                           SECTORS_PER_SLOT, bounce_page);
+    }
+    if (result == ZSWAP_STORED)
+      continue;
+
+    struct block_request *r = &requests[request_cnt++];
+    block_request_init(r, true, slots[i] * SECTORS_PER_SLOT,
+                       SECTORS_PER_SLOT, frames[i], NULL, NULL);
+    block_submit(device, r);
+  }
+  for (size_t i = 0; i < request_cnt; i++)
+    block_wait(&requests[i]);
 
-  return free_slot;
+  lock_release(&swap_lock);
 }
 
-void swap_to_frame(uint32_t slot, void *frame) {
-  ASSERT(bitmap_test(slots_occupied, slot) == true)
-
-  // write out every sector that makes up this slot
-  for (uint32_t i = 0; i < SECTORS_PER_SLOT; i++) {
-    block_sector_t sector_number = (slot * SECTORS_PER_SLOT) + i;
-    void *target = frame + (i * BLOCK_SECTOR_SIZE);
+bool swap_to_frame(uint32_t slot, void *frame) {
+  bool kept;
+  swap_to_frames(slot, &frame, 1, &kept);
+  return kept;
+}
 
-    block_read(device, sector_number, target);
+/* Reads the CNT consecutive slots starting at SLOT into FRAMES.
+   Slots held by the compressed tier are decompressed and freed.
+   Slots on disk are read, with all reads queued before waiting for
+   any of them so they reach the device as one transfer, and stay
+   allocated: as long as the page is not written to, the copy on disk
+   stays valid and evicting the page again needs no I/O.  KEPT[i]
+   tells whether slot SLOT + i is still allocated; the caller frees
+   kept slots with set_swap_index() once they go stale.  Slots shared
+   with other processes are always kept, compressed ones included. */
+void swap_to_frames(uint32_t slot, void **frames, size_t cnt, bool *kept) {
+  ASSERT(cnt <= SWAP_CLUSTER);
+
+  lock_acquire(&swap_lock);
+  ASSERT(bitmap_all(slots_occupied, slot, cnt) == true)
+
+  struct block_request requests[SWAP_CLUSTER];
+  size_t request_cnt = 0;
+  for (size_t i = 0; i < cnt; i++)
+  {
+    if (slot_refs[slot + i] > 1)
+    {
+      kept[i] = true;
+      if (zswap_copy(slot + i, frames[i]))
+        continue;
+    }
+    else
+    {
+      kept[i] = !zswap_load(slot + i, frames[i]);
+      if (!kept[i])
+      {
+        slot_refs[slot + i] = 0;
+        bitmap_reset(slots_occupied, slot + i);
+        continue;
+      }
+    }
+
+    struct block_request *r = &requests[request_cnt++];
+    block_request_init(r, false, (slot + i) * SECTORS_PER_SLOT,
+                       SECTORS_PER_SLOT, frames[i], NULL, NULL);
+    block_submit(device, r);
   }
+  for (size_t i = 0; i < request_cnt; i++)
+    block_wait(&requests[i]);
 
-  bitmap_set(slots_occupied, slot, false);
   //bitmap_dump(slots_occupied);
-}
\ No newline at end of file
+
+  lock_release(&swap_lock);
+}
@@ -9,9 +9,21 @@
 #ifndef PINTOS_SWAP_H
 #define PINTOS_SWAP_H
 
-void swap_init(void);
+/* Most pages frames_to_swap() writes in one batch. */
+#define SWAP_CLUSTER 8
+
+/* Swap slot of a page that has no copy in swap. */
+#define SWAP_SLOT_NONE ((size_t) -1)
+
+void swap_init(size_t zswap_pages);
 void set_swap_index(size_t slot, bool value);
+void swap_dup(size_t slot);
 size_t frame_to_swap(void *addr);
-void swap_to_frame(uint32_t slot, void *frame);
+void frames_to_swap(void **frames, size_t cnt, size_t *slots);
+void swap_alloc_slots(size_t cnt, size_t *slots);
+void swap_write_begin(void);
+void swap_write_end(void **frames, size_t cnt, const size_t *slots);
+bool swap_to_frame(uint32_t slot, void *frame);
+void swap_to_frames(uint32_t slot, void **frames, size_t cnt, bool *kept);
 
 #endif //PINTOS_SWAP_H
@@ -0,0 +1,160 @@
+//
+// Asynchronous write-back of evicted memory-mapped file pages.
+//
+// Eviction copies the dirty pages of a mapping into kernel pages and
+// queues them here, so the frames can be reused at once and the
+// evicting thread never waits for the file system.  A kernel thread
+// writes the queued runs out in order.  Until a run is written, its
+// file range is stale on disk: anyone about to read it back through
+// the mapping, or to close the mapping, waits for it first.
+//
+
+#include "writeback.h"
+#include <lib/kernel/list.h>
+#include <string.h>
+#include <debug.h>
+#include <filesys/file.h>
+#include <threads/malloc.h>
+#include <threads/palloc.h>
+#include <threads/synch.h>
+#include <threads/thread.h>
+#include <threads/vaddr.h>
+
+/* Kernel pages that queued runs may hold at once.  Beyond this,
+   writeback_submit() fails and the caller writes synchronously. */
+#define MAX_QUEUED_PAGES 32
+
+/* A run of adjacent pages of one file waiting to be written. */
+struct writeback_job {
+    struct list_elem elem;
+    struct file *file;       // own reference, closed when done
+    struct inode *inode;
+    off_t offset;
+    off_t length;
+    size_t page_cnt;
+    void *buffer;            // PAGE_CNT kernel pages
+};
+
+static struct lock wb_lock;
+static struct condition wb_queued;   // a job was added
+static struct condition wb_done;     // a job was written
+static struct list jobs;             // oldest first, front being written
+static size_t queued_pages;
+static bool started = false;
+
+static void writeback_thread(void *aux UNUSED)
+{
+  for (;;)
+  {
+    lock_acquire(&wb_lock);
+    while (list_empty(&jobs))
+      cond_wait(&wb_queued, &wb_lock);
+    struct writeback_job *job = list_entry(list_front(&jobs),
+                                           struct writeback_job, elem);
+    lock_release(&wb_lock);
+
+    // a mapping never grows its file, so this cannot race with
+    // anything that changes the file length
+    file_write_at(job->file, job->buffer, job->length, job->offset);
+
+    lock_acquire(&wb_lock);
+    list_remove(&job->elem);
+    queued_pages -= job->page_cnt;
+    cond_broadcast(&wb_done, &wb_lock);
+    lock_release(&wb_lock);
+
+    file_close(job->file);
+    palloc_free_multiple(job->buffer, job->page_cnt);
+    free(job);
+  }
+}
+
+void writeback_init()
+{
+  lock_init(&wb_lock);
+  cond_init(&wb_queued);
+  cond_init(&wb_done);
+  list_init(&jobs);
+  started = thread_create("mmap-writer", PRI_DEFAULT, writeback_thread,
+                          "system") != TID_ERROR;
+}
+
+/* Queues LENGTH bytes of FILE starting at OFFSET, held in the CNT
+   pages at PAGES, to be written in the background.  The data is
+   copied, so PAGES may be reused as soon as this returns.  Returns
+   false, queueing nothing, if the copy cannot be made; the caller
+   must then write the data itself. */
+bool writeback_submit(struct file *file, off_t offset, void **pages,
+                      size_t cnt, off_t length)
+{
+  ASSERT(cnt > 0 && cnt <= WRITEBACK_CLUSTER);
+  ASSERT(length > (off_t) ((cnt - 1) * PGSIZE) && length <= (off_t) (cnt * PGSIZE));
+
+  if (!started)
+    return false;
+
+  lock_acquire(&wb_lock);
+  bool room = queued_pages + cnt <= MAX_QUEUED_PAGES;
+  if (room)
+    queued_pages += cnt;
+  lock_release(&wb_lock);
+  if (!room)
+    return false;
+
+  struct writeback_job *job = malloc(sizeof *job);
+  void *buffer = palloc_get_multiple(0, cnt);
+  struct file *own = file_reopen(file);
+  if (job == NULL || buffer == NULL || own == NULL)
+  {
+    free(job);
+    if (buffer != NULL)
+      palloc_free_multiple(buffer, cnt);
+    file_close(own);
+    lock_acquire(&wb_lock);
+    queued_pages -= cnt;
+    lock_release(&wb_lock);
+    return false;
+  }
+
+  for (size_t i = 0; i < cnt; i++)
+    memcpy((uint8_t *) buffer + i * PGSIZE, pages[i], PGSIZE);
+
+  job->file = own;
+  job->inode = file_get_inode(file);
+  job->offset = offset;
+  job->length = length;
+  job->page_cnt = cnt;
+  job->buffer = buffer;
+
+  lock_acquire(&wb_lock);
+  list_push_back(&jobs, &job->elem);
+  cond_signal(&wb_queued, &wb_lock);
+  lock_release(&wb_lock);
+  return true;
+}
+
+static bool range_pending(struct inode *inode, off_t offset, off_t length)
+{
+  struct list_elem *e;
+  for (e = list_begin(&jobs); e != list_end(&jobs); e = list_next(e))
+  {
+    struct writeback_job *job = list_entry(e, struct writeback_job, elem);
+    if (job->inode == inode && job->offset < offset + length
+        && offset < job->offset + job->length)
+      return true;
+  }
+  return false;
+}
+
+/* Waits until no queued write overlaps the LENGTH bytes of INODE
+   starting at OFFSET. */
+void writeback_wait(struct inode *inode, off_t offset, off_t length)
+{
+  if (!started)
+    return;
+
+  lock_acquire(&wb_lock);
+  while (range_pending(inode, offset, length))
+    cond_wait(&wb_done, &wb_lock);
+  lock_release(&wb_lock);
+}
@@ -0,0 +1,23 @@
+//
+// Asynchronous write-back of evicted memory-mapped file pages.
+//
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <filesys/off_t.h>
+
+#ifndef PINTOS_WRITEBACK_H
+#define PINTOS_WRITEBACK_H
+
+struct file;
+struct inode;
+
+/* Most adjacent pages of one mapping written back together. */
+#define WRITEBACK_CLUSTER 8
+
+void writeback_init(void);
+bool writeback_submit(struct file *file, off_t offset, void **pages,
+                      size_t cnt, off_t length);
+void writeback_wait(struct inode *inode, off_t offset, off_t length);
+
+#endif //PINTOS_WRITEBACK_H
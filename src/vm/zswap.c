@@ -0,0 +1,255 @@
+//
+// Compressed in-memory tier in front of the swap device.
+//
+// Pages on their way to swap are compressed with a small LZ77
+// variant and packed into an arena of kernel pages, keyed by the swap
+// slot they were given.  Reading a page back from the arena costs a
+// decompression instead of a disk transfer.  When the arena is full,
+// the least recently stored page is handed back to the caller to be
+// written to its slot on disk.
+//
+
+#include "zswap.h"
+#include <lib/kernel/bitmap.h>
+#include <lib/kernel/list.h>
+#include <stdint.h>
+#include <string.h>
+#include <debug.h>
+#include <threads/malloc.h>
+#include <threads/palloc.h>
+#include <threads/vaddr.h>
+
+/* The arena is handed out in chunks of this many bytes. */
+#define CHUNK_SIZE 128
+#define CHUNKS_PER_PAGE (PGSIZE / CHUNK_SIZE)
+
+/* Pages that do not compress below this size go to disk directly. */
+#define MAX_STORED_LEN (PGSIZE * 3 / 4)
+
+/* Compressed stream format: a control byte followed by up to eight
+   items, bit I of the control byte telling whether item I is a
+   literal byte (0) or a two-byte back reference (1) holding a
+   12-bit distance and a 4-bit length. */
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_OFFSET 4095
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* A page held in the arena. */
+struct zswap_entry {
+    struct list_elem lru_elem;   // in lru, oldest at the front
+    uint16_t chunk;              // first arena chunk
+    uint16_t len;                // compressed length, 0 if not stored
+};
+
+static struct zswap_entry *entries;   // indexed by swap slot
+static size_t entry_cnt;
+static uint8_t *arena;
+static struct bitmap *chunks_used;
+static struct list lru;
+
+// compressor scratch space, too large for a kernel stack.
+// all callers are serialized by the swap lock.
+static uint16_t lz_table[LZ_HASH_SIZE];
+static uint8_t lz_buffer[MAX_STORED_LEN];
+
+static unsigned lz_hash(const uint8_t *p)
+{
+  uint32_t v = p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16);
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Compresses the page at SRC into DST, which holds DST_SIZE bytes.
+   Returns the compressed length, or 0 if it does not fit. */
+static size_t lz_compress(const uint8_t *src, uint8_t *dst, size_t dst_size)
+{
+  size_t ip = 0;
+  size_t op = 0;
+
+  // table entries hold a position plus one, so 0 means empty
+  memset(lz_table, 0, sizeof lz_table);
+
+  while (ip < PGSIZE)
+  {
+    // worst case for one group: control byte plus eight references
+    if (op + 1 + 8 * 2 > dst_size)
+      return 0;
+
+    size_t ctrl_pos = op++;
+    uint8_t ctrl = 0;
+    for (int bit = 0; bit < 8 && ip < PGSIZE; bit++)
+    {
+      size_t len = 0;
+      size_t offset = 0;
+      if (ip + LZ_MIN_MATCH <= PGSIZE)
+      {
+        unsigned h = lz_hash(src + ip);
+        size_t candidate = lz_table[h];
+        lz_table[h] = ip + 1;
+        if (candidate != 0 && ip - (candidate - 1) <= LZ_MAX_OFFSET)
+        {
+          const uint8_t *m = src + candidate - 1;
+          size_t max = PGSIZE - ip < LZ_MAX_MATCH ? PGSIZE - ip : LZ_MAX_MATCH;
+          while (len < max && m[len] == src[ip + len])
+            len++;
+          offset = ip - (candidate - 1);
+        }
+      }
+
+      if (len >= LZ_MIN_MATCH)
+      {
+        ctrl |= 1 << bit;
+        dst[op++] = offset >> 4;
+        dst[op++] = ((offset & 0xf) << 4) | (len - LZ_MIN_MATCH);
+        ip += len;
+      }
+      else
+        dst[op++] = src[ip++];
+    }
+    dst[ctrl_pos] = ctrl;
+  }
+
+  return op;
+}
+
+/* Expands the SRC_LEN bytes at SRC, produced by lz_compress(), into
+   the page at DST. */
+static void lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+  size_t ip = 0;
+  size_t op = 0;
+
+  while (ip < src_len)
+  {
+    uint8_t ctrl = src[ip++];
+    for (int bit = 0; bit < 8 && ip < src_len; bit++)
+    {
+      if (ctrl & (1 << bit))
+      {
+        size_t offset = (src[ip] << 4) | (src[ip + 1] >> 4);
+        size_t len = (src[ip + 1] & 0xf) + LZ_MIN_MATCH;
+        ip += 2;
+        ASSERT(offset <= op && op + len <= PGSIZE);
+        // byte by byte, the reference may overlap what it produces
+        for (size_t i = 0; i < len; i++, op++)
+          dst[op] = dst[op - offset];
+      }
+      else
+        dst[op++] = src[ip++];
+    }
+  }
+
+  ASSERT(op == PGSIZE);
+}
+
+static size_t chunks_for(size_t len)
+{
+  return (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+/* Sets up a tier of ARENA_PAGES kernel pages for a swap device of
+   NUM_SLOTS slots.  The tier stays disabled if ARENA_PAGES is 0 or
+   the memory is not available. */
+void zswap_init(size_t num_slots, size_t arena_pages)
+{
+  list_init(&lru);
+  if (arena_pages == 0 || num_slots == 0)
+    return;
+
+  // chunk numbers are stored in 16 bits
+  if (arena_pages * CHUNKS_PER_PAGE > UINT16_MAX)
+    arena_pages = UINT16_MAX / CHUNKS_PER_PAGE;
+
+  entries = calloc(num_slots, sizeof *entries);
+  arena = palloc_get_multiple(0, arena_pages);
+  chunks_used = bitmap_create(arena_pages * CHUNKS_PER_PAGE);
+  if (entries == NULL || arena == NULL || chunks_used == NULL)
+  {
+    free(entries);
+    if (arena != NULL)
+      palloc_free_multiple(arena, arena_pages);
+    if (chunks_used != NULL)
+      bitmap_destroy(chunks_used);
+    entries = NULL;
+    arena = NULL;
+    chunks_used = NULL;
+    return;
+  }
+  entry_cnt = num_slots;
+}
+
+/* Tries to keep a compressed copy of PAGE for SLOT. */
+enum zswap_result zswap_store(size_t slot, const void *page)
+{
+  if (arena == NULL)
+    return ZSWAP_INCOMPRESSIBLE;
+  ASSERT(slot < entry_cnt);
+  ASSERT(entries[slot].len == 0);
+
+  size_t len = lz_compress(page, lz_buffer, sizeof lz_buffer);
+  if (len == 0)
+    return ZSWAP_INCOMPRESSIBLE;
+
+  size_t cnt = chunks_for(len);
+  size_t chunk = bitmap_scan_and_flip(chunks_used, 0, cnt, false);
+  if (chunk == BITMAP_ERROR)
+    return list_empty(&lru) ? ZSWAP_INCOMPRESSIBLE : ZSWAP_FULL;
+
+  memcpy(arena + chunk * CHUNK_SIZE, lz_buffer, len);
+  entries[slot].chunk = chunk;
+  entries[slot].len = len;
+  list_push_back(&lru, &entries[slot].lru_elem);
+  return ZSWAP_STORED;
+}
+
+/* If SLOT is held in the arena, decompresses it into PAGE and
+   returns true, keeping the compressed copy.  Otherwise returns
+   false. */
+bool zswap_copy(size_t slot, void *page)
+{
+  if (arena == NULL || entries[slot].len == 0)
+    return false;
+
+  struct zswap_entry *e = &entries[slot];
+  lz_decompress(arena + e->chunk * CHUNK_SIZE, e->len, page);
+  return true;
+}
+
+/* Like zswap_copy(), but releases the compressed copy. */
+bool zswap_load(size_t slot, void *page)
+{
+  if (!zswap_copy(slot, page))
+    return false;
+
+  zswap_drop(slot);
+  return true;
+}
+
+/* Forgets the compressed copy of SLOT, if there is one. */
+void zswap_drop(size_t slot)
+{
+  if (arena == NULL || entries[slot].len == 0)
+    return;
+
+  struct zswap_entry *e = &entries[slot];
+  list_remove(&e->lru_elem);
+  bitmap_set_multiple(chunks_used, e->chunk, chunks_for(e->len), false);
+  e->len = 0;
+}
+
+/* Makes room by removing the least recently stored page from the
+   arena.  Decompresses it into PAGE and returns its slot, which the
+   caller must write to disk.  Returns BITMAP_ERROR if the arena is
+   empty. */
+size_t zswap_evict(void *page)
+{
+  if (list_empty(&lru))
+    return BITMAP_ERROR;
+
+  struct zswap_entry *e = list_entry(list_front(&lru), struct zswap_entry,
+                                     lru_elem);
+  size_t slot = e - entries;
+  zswap_load(slot, page);
+  return slot;
+}
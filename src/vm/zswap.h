@@ -0,0 +1,25 @@
+//
+// Compressed in-memory tier in front of the swap device.
+//
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef PINTOS_ZSWAP_H
+#define PINTOS_ZSWAP_H
+
+/* Outcome of zswap_store(). */
+enum zswap_result {
+    ZSWAP_STORED,           /* Page is now held compressed. */
+    ZSWAP_FULL,             /* No room; evict with zswap_evict(). */
+    ZSWAP_INCOMPRESSIBLE    /* Not worth keeping, write it to disk. */
+};
+
+void zswap_init(size_t num_slots, size_t arena_pages);
+enum zswap_result zswap_store(size_t slot, const void *page);
+bool zswap_copy(size_t slot, void *page);
+bool zswap_load(size_t slot, void *page);
+void zswap_drop(size_t slot);
+size_t zswap_evict(void *page);
+
+#endif //PINTOS_ZSWAP_H